@@ -24,12 +24,12 @@ using namespace uix;
 
 // 240x240 or 96x96
 static constexpr const int big_cam = 1;
+// stream the camera straight to the LCD instead of drawing it through uix
+static constexpr const int direct_cam = 1;
 
 static SemaphoreHandle_t audio_sync = NULL;
 static float audio_amplitude = 0;
 
-static uint32_t prox_average;  // Average IR at power up
-
 struct tsf_allocator tsf_alloc;
 struct tsf* tsf_handle;
 struct tml_allocator tml_alloc;
@@ -205,17 +205,29 @@ void setup() {
     }
     lcd_initialize(lcd_transfer_size);
     touch_initialize(TOUCH_THRESH_DEFAULT);
+    touch_events_initialize(0);
     uint32_t total_ms = 0;
     int frames = 0;
     uint32_t ts_ms = pdTICKS_TO_MS(xTaskGetTickCount());
     const int wmo = big_cam?239:95;
     srect16 sr(0,0,wmo,wmo);
-    cam_bmp = create_bitmap<typename screen_t::pixel_type>((size16)sr.dimensions(),ps_malloc);
-    if(cam_bmp.begin()==nullptr) {
-        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    if (!direct_cam) {
+        cam_bmp = create_bitmap<typename screen_t::pixel_type>((size16)sr.dimensions(),ps_malloc);
+        if(cam_bmp.begin()==nullptr) {
+            ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+        }
+        camera_initialize(CAM_ALLOC_CAM_PSRAM | CAM_ALLOC_FB_PSRAM | CAM_PROFILE);
+        // capture on the other core while we draw
+        camera_pipeline_initialize(2, 1 - xTaskGetAffinity(xTaskGetCurrentTaskHandle()));
+        // only send the parts of the view that changed
+        camera_motion_initialize(8, 12);
+    } else {
+        // two buffers, newest frame wins: the lowest latency preview
+        camera_settings_t cam_settings;
+        camera_default_settings(CAM_ALLOC_CAM_PSRAM | CAM_DIRECT_LCD | CAM_PROFILE, &cam_settings);
+        cam_settings.fb_count = 2;
+        camera_initialize_settings(CAM_ALLOC_CAM_PSRAM | CAM_DIRECT_LCD | CAM_PROFILE, &cam_settings);
     }
-    
-    camera_initialize(CAM_ALLOC_CAM_PSRAM | CAM_ALLOC_FB_PSRAM);
     camera_rotation(0);
     lcd_rotation(0);
     touch_rotation(0);
@@ -248,27 +260,14 @@ void setup() {
     prox_sensor_configure(PROX_SENS_AMP_50MA, PROX_SENS_SAMPLEAVG_4,
                           PROX_SENS_MODE_REDIRONLY, PROX_SENS_SAMPLERATE_400,
                           PROX_SENS_PULSEWIDTH_411, PROX_SENS_ADCRANGE_2048);
-    // Take an average of IR readings at power up
-    prox_average = 0;
-    int avg_div = 0;
-    for (int j = 0; j < 10; ++j) {
-        for (uint8_t x = 0; x < 32; ++x) {
-            uint32_t ir;
-            if (0 != prox_sensor_read_raw(NULL, &ir, NULL, 250)) {
-                prox_average += ir;
-                ++avg_div;
-            }
-            vTaskDelay(1);
-        }
-        if (avg_div >= 32) {
-            break;
-        }
-    }
-    if (avg_div == 0) {
-        puts("Retry count for prox sensor exceeded");
+    // keep the presence estimate current in the background
+    prox_sensor_task_initialize(-1);
+    // idle down after two seconds of nothing
+    prox_sensor_adaptive(2000);
+    if (0 == prox_sensor_read_raw(NULL, NULL, NULL, 250)) {
+        puts("Prox sensor isn't producing samples");
         ESP_ERROR_CHECK(ESP_ERR_INVALID_RESPONSE);
     }
-    prox_average /= avg_div;
     // led_initialize(); // conflicts with touch/i2c
     printf("Free SRAM: %0.2fKB, free PSRAM: %0.2fMB\n",
            heap_caps_get_free_size(MALLOC_CAP_INTERNAL) / 1024.f,
@@ -279,27 +278,71 @@ static uint32_t total_ms = 0;
 static uint32_t ts_ms = 0;
 static int col = 0;
 static char fps_buf[64];
+static bool fps_pending = false;
+static bool cam_refresh = true;
 void loop() {
     uint32_t start_ms = pdTICKS_TO_MS(xTaskGetTickCount());
-    const_bitmap<rgb_pixel<16>> cbmp((size16)cam_view.dimensions(),camera_frame_buffer());
-    draw::bitmap(cam_bmp,cam_bmp.bounds(),cbmp,cbmp.bounds());
-    cam_view.update();
-    lcd_display.update();
-    uint16_t x, y;
-    if (touch_xy(&x, &y)) {
-        printf("touch: (%d, %d)\n", x, y);
+    if (!direct_cam) {
+        const void* frame = camera_acquire_frame(0);
+        const_bitmap<rgb_pixel<16>> cbmp((size16)cam_view.dimensions(),frame);
+        draw::bitmap(cam_bmp,cam_bmp.bounds(),cbmp,cbmp.bounds());
+        camera_release_frame(frame);
+        // let the flush planner decide whether what moved in the camera
+        // view and the fps label are cheaper to send as one window or more.
+        // the whole view goes out once a second, to catch slow changes the
+        // detector soaks into its background
+        const srect16& cb = cam_view.bounds();
+        if (cam_refresh) {
+            lcd_dirty_add(cb.x1, cb.y1, cb.x2, cb.y2);
+            cam_refresh = false;
+        } else {
+            camera_motion_box_t boxes[4];
+            size_t box_count = camera_motion_boxes(boxes, 4);
+            for (size_t i = 0; i < box_count; ++i) {
+                lcd_dirty_add(cb.x1 + boxes[i].x1, cb.y1 + boxes[i].y1,
+                              cb.x1 + boxes[i].x2, cb.y1 + boxes[i].y2);
+            }
+        }
+        if (fps_pending) {
+            const srect16& fb = fps_label.bounds();
+            lcd_dirty_add(fb.x1, fb.y1, fb.x2, fb.y2);
+        }
+        lcd_rect_t plan[4];
+        size_t plan_count = lcd_dirty_plan(plan, 4);
+        for (size_t i = 0; i < plan_count; ++i) {
+            main_screen.invalidate(srect16(plan[i].x1, plan[i].y1, plan[i].x2, plan[i].y2));
+        }
+        // these now fall inside what's already invalidated
+        if (fps_pending) {
+            fps_label.text(fps_buf);
+            fps_pending = false;
+        }
+        lcd_display.update();
+    } else {
+        if (fps_pending) {
+            fps_label.text(fps_buf);
+            fps_pending = false;
+        }
+        lcd_display.update();
+        camera_lcd_flush(cam_view.bounds().x1, cam_view.bounds().y1);
+    }
+    touch_event_t touch_event;
+    while (touch_event_read(&touch_event)) {
+        static const char* touch_names[] = {"down", "move", "up"};
+        printf("touch %s #%d: (%d, %d)\n", touch_names[touch_event.type],
+               (int)touch_event.id, (int)touch_event.x, (int)touch_event.y);
     }
-    uint32_t ir;
-    prox_sensor_read_raw(NULL, &ir, NULL, 250);
-    long currentDelta = ir - prox_average;
-    if (currentDelta > 500) {
-        currentDelta = 500;
-    } else if (currentDelta < 0) {
-        currentDelta = 0;
+    touch_gesture_t gesture;
+    while (touch_gesture_read(&gesture)) {
+        static const char* gesture_names[] = {"tap", "long press", "swipe", "pinch"};
+        printf("gesture %s at (%d, %d), moved (%d, %d), scale %0.2f\n",
+               gesture_names[gesture.type], (int)gesture.x, (int)gesture.y,
+               (int)gesture.dx, (int)gesture.dy, gesture.scale);
     }
-    float amp = currentDelta / 1000.f;
-    if (ir < prox_average) {
-        amp = .025;
+    float prox_level;
+    float amp = .025;
+    if (prox_sensor_presence(&prox_level, NULL)) {
+        amp += prox_level * .475f;
     }
     xSemaphoreTake(audio_sync, portMAX_DELAY);
     audio_amplitude = amp;
@@ -314,11 +357,42 @@ void loop() {
             col = 0;
         }
         neopixel_color(255 * (col == 1), 255 * (col == 2), 255 * (col == 3));
+        cam_refresh = true;
         if (frames > 0) {
             sprintf(fps_buf, "FPS: %d, avg ms: %0.2f", frames,
                    (float)total_ms / (float)frames);
-            fps_label.text(fps_buf);
+            fps_pending = true;
             puts(fps_buf);
+            uint32_t lcd_sent, lcd_elided;
+            lcd_command_stats(&lcd_sent, &lcd_elided, 1);
+            printf("LCD commands/frame: %0.1f sent, %0.1f elided\n",
+                   (float)lcd_sent / (float)frames,
+                   (float)lcd_elided / (float)frames);
+            i2c_bus_stats_t touch_stats, prox_stats;
+            i2c_bus_stats(0x38, &touch_stats, 1);
+            i2c_bus_stats(0x57, &prox_stats, 1);
+            printf("I2C touch: %d xfers, %d bytes, avg %dus; prox: %d xfers, %d bytes, avg %dus\n",
+                   (int)touch_stats.transactions, (int)(touch_stats.bytes_written + touch_stats.bytes_read),
+                   (int)touch_stats.latency_avg_us, (int)prox_stats.transactions,
+                   (int)(prox_stats.bytes_written + prox_stats.bytes_read),
+                   (int)prox_stats.latency_avg_us);
+            camera_profile_t cam_profile;
+            camera_profile(&cam_profile, 1);
+            printf("Camera: %d frames, %d dropped, latency ms min/avg/max: %0.1f/%0.1f/%0.1f\n",
+                   (int)cam_profile.frames, (int)cam_profile.dropped,
+                   cam_profile.latency_min_us / 1000.0f,
+                   cam_profile.latency_avg_us / 1000.0f,
+                   cam_profile.latency_max_us / 1000.0f);
+            static const char* stage_names[] = {"capture", "process", "deliver", "total"};
+            for (int i = 0; i < CAMERA_STAGE_COUNT; ++i) {
+                uint32_t buckets[CAMERA_HISTOGRAM_BUCKETS];
+                camera_latency_histogram((camera_stage_t)i, buckets, 1);
+                printf("  %-8s", stage_names[i]);
+                for (int j = 0; j < CAMERA_HISTOGRAM_BUCKETS; ++j) {
+                    printf(" %3d", (int)buckets[j]);
+                }
+                puts("");
+            }
         }
         total_ms = 0;
         frames = 0;
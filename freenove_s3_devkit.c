@@ -1,17 +1,29 @@
 #include "freenove_s3_devkit.h"
 #include <memory.h>
+#include <math.h>
+#include <stdio.h>
 #include "driver/gpio.h"
 #include "driver/i2s_std.h"
 #include "driver/spi_master.h"
 #include "esp_camera.h"
+#include "img_converters.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "hal/gpio_ll.h"
 #include "esp_vfs_fat.h"
 #include "sdmmc_cmd.h"
 #include "driver/sdmmc_host.h"
-// TODO: Update the following when the camera component is updated
+#include "diskio_sdmmc.h"
+// the legacy and new I2C drivers can't both be linked in, so use whichever
+// one the camera component was built against
+#if CONFIG_SCCB_HARDWARE_I2C_DRIVER_NEW
+#include "driver/i2c_master.h"
+#else
 #include "driver/i2c.h"
+#endif
 
 #define LCD_DC 0
 #define LCD_CS 47
@@ -49,6 +61,16 @@
 #define I2C_SDA 2
 #define I2C_SPEED (200*1000)
 
+// the touch controller's INT line isn't wired on this board. set this to a
+// GPIO if yours is, and touch events will only touch the bus while touched
+#ifndef TOUCH_INT
+#define TOUCH_INT -1
+#endif
+// likewise the prox sensor's
+#ifndef PROX_INT
+#define PROX_INT -1
+#endif
+
 #define SDMMC_D0 40
 #define SDMMC_CLK 39
 #define SDMMC_CMD 38
@@ -60,22 +82,82 @@
 #define LED_ON GPIO.out_w1ts = (1 << LED);
 
 static spi_device_handle_t lcd_spi_handle = NULL;
-static spi_transaction_t lcd_trans[14];
+static spi_transaction_t lcd_trans[LCD_TRANS_QUEUE_SIZE];
 static size_t lcd_trans_index = 0;
+static size_t lcd_trans_in_flight = 0;
 static int lcd_rot = 0;
-static volatile int lcd_flushing = 0;
-
-static void lcd_command(uint8_t cmd, const uint8_t* args, size_t len) {
+static size_t lcd_max_transfer = 0;
+// flushes are numbered as they're queued. the post callback counts them off
+// as their last transaction completes, and wakes whoever is waiting on one
+static uint32_t lcd_flush_submitted = 0;
+static volatile uint32_t lcd_flush_completed = 0;
+// when the last few flushes finished, indexed by sequence
+#define LCD_FLUSH_TIMES 8
+static volatile int64_t lcd_flush_times[LCD_FLUSH_TIMES];
+// the tasks waiting on a flush, and which flush each is waiting for
+#define LCD_WAITERS 4
+typedef struct {
+    TaskHandle_t task;
+    uint32_t sequence;
+} lcd_waiter_t;
+static lcd_waiter_t lcd_waiters[LCD_WAITERS];
+static portMUX_TYPE lcd_wait_lock = portMUX_INITIALIZER_UNLOCKED;
+// what the controller currently has for CASET, RASET and MADCTL
+static uint8_t lcd_window_cols[4];
+static uint8_t lcd_window_rows[4];
+static int lcd_window_valid = 0;
+static uint8_t lcd_madctl = 0;
+static int lcd_madctl_valid = 0;
+static uint32_t lcd_commands_sent = 0;
+static uint32_t lcd_commands_elided = 0;
+// measured SPI cost, used by the dirty rectangle planner. a transaction's
+// cost runs from when it could have started, which is when it was queued or
+// when the one ahead of it finished, to when it finished. that takes in the
+// queueing, DMA setup, interrupts and the gap between transactions as well
+// as the bits on the wire
+static int64_t lcd_trans_queued_us[LCD_TRANS_QUEUE_SIZE];
+static volatile int64_t lcd_trans_done_us = 0;
+static volatile uint32_t lcd_cost_cmd_ns = 0;
+static volatile uint32_t lcd_cost_byte_ps = 0;
+
+// Transactions are used round robin, and the SPI master completes them in
+// order, so once the ring is full the next one we hand out is the oldest
+// still in flight. Wait for it to come back before we reuse it.
+static spi_transaction_t* lcd_trans_next(void) {
+    if (lcd_trans_in_flight == LCD_TRANS_QUEUE_SIZE) {
+        spi_transaction_t* done;
+        ESP_ERROR_CHECK(spi_device_get_trans_result(lcd_spi_handle, &done,
+                                                    portMAX_DELAY));
+        --lcd_trans_in_flight;
+    }
     spi_transaction_t* tx = &lcd_trans[lcd_trans_index++];
-    if (lcd_trans_index > 13) lcd_trans_index = 0;
+    if (lcd_trans_index == LCD_TRANS_QUEUE_SIZE) lcd_trans_index = 0;
+    return tx;
+}
+static void lcd_trans_queue(spi_transaction_t* tx) {
+    lcd_trans_queued_us[tx - lcd_trans] = esp_timer_get_time();
+    ESP_ERROR_CHECK(spi_device_queue_trans(lcd_spi_handle, tx, portMAX_DELAY));
+    ++lcd_trans_in_flight;
+}
+// collect completed transactions, waiting up to timeout for each
+static void lcd_trans_reclaim(uint32_t timeout) {
+    spi_transaction_t* done;
+    while (lcd_trans_in_flight > 0 &&
+           ESP_OK ==
+               spi_device_get_trans_result(lcd_spi_handle, &done, timeout)) {
+        --lcd_trans_in_flight;
+    }
+}
+static void lcd_command(uint8_t cmd, const uint8_t* args, size_t len) {
+    ++lcd_commands_sent;
+    spi_transaction_t* tx = lcd_trans_next();
     tx->length = 8;
     tx->tx_data[0] = cmd;
     tx->user = (void*)0;
     tx->flags = SPI_TRANS_USE_TXDATA;
-    spi_device_queue_trans(lcd_spi_handle, tx, portMAX_DELAY);
+    lcd_trans_queue(tx);
     if (len && args) {
-        tx = &lcd_trans[lcd_trans_index++];
-        if (lcd_trans_index > 13) lcd_trans_index = 0;
+        tx = lcd_trans_next();
         tx->length = 8 * len;
         if (len <= 4) {
             memcpy(tx->tx_data, args, len);
@@ -85,7 +167,7 @@ static void lcd_command(uint8_t cmd, const uint8_t* args, size_t len) {
             tx->flags = 0;
         }
         tx->user = (void*)1;
-        spi_device_queue_trans(lcd_spi_handle, tx, portMAX_DELAY);
+        lcd_trans_queue(tx);
     }
 }
 IRAM_ATTR static void lcd_spi_pre_cb(spi_transaction_t* trans) {
@@ -93,24 +175,98 @@ IRAM_ATTR static void lcd_spi_pre_cb(spi_transaction_t* trans) {
         DC_C;
     }
 }
+IRAM_ATTR static void lcd_spi_measure(spi_transaction_t* trans) {
+    int64_t now = esp_timer_get_time();
+    int64_t start = lcd_trans_queued_us[trans - lcd_trans];
+    if (start < lcd_trans_done_us) {
+        start = lcd_trans_done_us;
+    }
+    lcd_trans_done_us = now;
+    uint32_t ns = (uint32_t)(now - start) * 1000;
+    uint32_t cmd_ns = lcd_cost_cmd_ns;
+    if (trans->length == 8) {
+        // single command byte: this is almost entirely per transaction overhead
+        lcd_cost_cmd_ns = cmd_ns == 0 ? ns : (cmd_ns * 7 + ns) / 8;
+    } else if (((int)trans->user) != 0 && trans->length >= 8 * 1024 &&
+               cmd_ns != 0 && ns > cmd_ns) {
+        // large pixel transfer: past the overhead, this is all bus time
+        uint32_t ps = (uint32_t)(((uint64_t)(ns - cmd_ns) * 1000) /
+                                 (trans->length / 8));
+        lcd_cost_byte_ps = lcd_cost_byte_ps == 0
+                               ? ps
+                               : (lcd_cost_byte_ps * 7 + ps) / 8;
+    }
+}
 IRAM_ATTR static void lcd_spi_post_cb(spi_transaction_t* trans) {
-    lcd_flushing = 0;
+    lcd_spi_measure(trans);
     if (((int)trans->user) == 0) {
         DC_D;
     } else {
-        if (((int)trans->user) == 2) {
-            lcd_on_flush_complete();
+        // 2 ends a flush, 3 ends one that doesn't notify the user
+        if (((int)trans->user) >= 2) {
+            uint32_t completed = lcd_flush_completed + 1;
+            lcd_flush_times[completed % LCD_FLUSH_TIMES] = esp_timer_get_time();
+            lcd_flush_completed = completed;
+            if (((int)trans->user) == 2) {
+                lcd_on_flush_complete();
+            }
+            BaseType_t woken = pdFALSE;
+            portENTER_CRITICAL_ISR(&lcd_wait_lock);
+            for (size_t i = 0; i < LCD_WAITERS; ++i) {
+                if (lcd_waiters[i].task != NULL &&
+                    (int32_t)(completed - lcd_waiters[i].sequence) >= 0) {
+                    vTaskNotifyGiveFromISR(lcd_waiters[i].task, &woken);
+                }
+            }
+            portEXIT_CRITICAL_ISR(&lcd_wait_lock);
+            portYIELD_FROM_ISR(woken);
         }
     }
 }
+static void lcd_set_window(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2) {
+    // the controller keeps the window between RAMWRs, so only send what changed
+    uint8_t args[4];
+    args[0] = (x1 >> 8);
+    args[1] = (x1 & 0xFF);
+    args[2] = (x2 >> 8);
+    args[3] = (x2 & 0xFF);
+    if (lcd_window_valid && 0 == memcmp(lcd_window_cols, args, 4)) {
+        ++lcd_commands_elided;
+    } else {
+        lcd_command(0x2A, args, 4);
+        memcpy(lcd_window_cols, args, 4);
+    }
+    args[0] = (y1 >> 8);
+    args[1] = (y1 & 0xFF);
+    args[2] = (y2 >> 8);
+    args[3] = (y2 & 0xFF);
+    if (lcd_window_valid && 0 == memcmp(lcd_window_rows, args, 4)) {
+        ++lcd_commands_elided;
+    } else {
+        lcd_command(0x2B, args, 4);
+        memcpy(lcd_window_rows, args, 4);
+    }
+    lcd_window_valid = 1;
+}
+static void lcd_set_madctl(uint8_t param) {
+    if (lcd_madctl_valid && param == lcd_madctl) {
+        ++lcd_commands_elided;
+        return;
+    }
+    lcd_command(0x36, &param, 1);
+    lcd_madctl = param;
+    lcd_madctl_valid = 1;
+}
+
 static void lcd_st7789_init() {
+    lcd_window_valid = 0;
+    lcd_madctl_valid = 0;
     lcd_command(0x01, NULL, 0);      // reset
     vTaskDelay(pdMS_TO_TICKS(120));  // Wait for reset to complete
     lcd_command(0x11, NULL, 0);      // Sleep out
     vTaskDelay(pdMS_TO_TICKS(120));
     lcd_command(0x13, NULL, 0);  // Normal display mode on
-    static const uint8_t params1 = 0x08;
-    lcd_command(0x36, &params1, 1);
+    lcd_set_madctl(0x08);
     static const uint8_t params2[] = {0x0A, 0xB2};
     lcd_command(0xB6, params2, 2);
     static const uint8_t params3[] = {0x00, 0xE0};
@@ -145,91 +301,176 @@ static void lcd_st7789_init() {
                                        0x1C, 0x17, 0x1B, 0x1E};
     lcd_command(0xE1, params15, 14);
     lcd_command(0x21, NULL, 0);
-    static const uint8_t params16[] = {0x00, 0x00, 0x00, 0xEF};
-    lcd_command(0x2A, params16, 4);  // Column address set
-    static const uint8_t params17[] = {0x00, 0x00, 0x01, 0x3F};
-    lcd_command(0x2B, params17, 4);  // Row address set
+    lcd_set_window(0, 0, 239, 319);  // Column and row address set
     vTaskDelay(pdMS_TO_TICKS(120));
     lcd_command(0x29, NULL, 0);
     vTaskDelay(pdMS_TO_TICKS(120));
     lcd_command(0x20, NULL, 0);
 }
-static void lcd_set_window(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2) {
-    uint8_t args[4];
-    args[0] = (x1 >> 8);
-    args[1] = (x1 & 0xFF);
-    args[2] = (x2 >> 8);
-    args[3] = (x2 & 0xFF);
-    lcd_command(0x2A, args, 4);
-    args[0] = (y1 >> 8);
-    args[1] = (y1 & 0xFF);
-    args[2] = (y2 >> 8);
-    args[3] = (y2 & 0xFF);
-    lcd_command(0x2B, args, 4);
+// cmd is RAMWR (0x2C) to start at the top of the window, or RAMWRC (0x3C)
+// to continue where the last write left off. Only the last write of a flush
+// signals completion, via the user value passed as last.
+static void lcd_write_bitmap(const void* data_in, uint32_t len, uint8_t cmd,
+                             int last) {
+    ++lcd_commands_sent;
+    spi_transaction_t* tx = lcd_trans_next();
+    tx->user = (void*)0;
+    tx->flags = SPI_TRANS_USE_TXDATA;
+    tx->tx_data[0] = cmd;
+    tx->length = 8;
+    lcd_trans_queue(tx);
+
+    tx = lcd_trans_next();
+    tx->flags = 0;
+    tx->length = 8 * (len * 2);
+    tx->tx_buffer = data_in;
+    tx->user = (void*)(last ? last : 1);
+    lcd_trans_queue(tx);
 }
 
-static void lcd_write_bitmap(const void* data_in, uint32_t len) {
-    if (len) {
-        spi_transaction_t* tx = &lcd_trans[lcd_trans_index++];
-        if (lcd_trans_index > 13) lcd_trans_index = 0;
-        tx->user = (void*)0;
-        tx->flags = SPI_TRANS_USE_TXDATA;
-        tx->tx_data[0] = 0x2C;  // RAMWR
-        tx->length = 8;
-        ESP_ERROR_CHECK(
-            spi_device_queue_trans(lcd_spi_handle, tx, portMAX_DELAY));
-
-        tx = &lcd_trans[lcd_trans_index++];
-        if (lcd_trans_index > 13) lcd_trans_index = 0;
-        tx->flags = 0;
-        tx->length = 8 * (len * 2);
-        tx->tx_buffer = data_in;
-        tx->user = (void*)2;
-        ESP_ERROR_CHECK(
-            spi_device_queue_trans(lcd_spi_handle, tx, portMAX_DELAY));
-    } else {
-        lcd_flushing = 0;
-        lcd_on_flush_complete();
+uint32_t lcd_flush_sequence(void) { return lcd_flush_submitted; }
+int lcd_flush_done(uint32_t sequence) {
+    return (int32_t)(lcd_flush_completed - sequence) >= 0;
+}
+// when the flush finished, or -1 if it hasn't or it's too long ago to know
+static int64_t lcd_flush_time(uint32_t sequence) {
+    int64_t result = lcd_flush_times[sequence % LCD_FLUSH_TIMES];
+    uint32_t age = lcd_flush_completed - sequence;
+    if ((int32_t)age < 0 || age >= LCD_FLUSH_TIMES - 1) {
+        return -1;
     }
+    return result;
 }
-
-int lcd_wait_flush(uint32_t timeout) {
-    uint32_t ms = pdTICKS_TO_MS(xTaskGetTickCount());
-    uint32_t total_ms = 0;
-    while ((timeout == 0 || total_ms <= timeout) && lcd_flushing > 0) {
-        taskYIELD();
-        uint32_t new_ms = pdTICKS_TO_MS(xTaskGetTickCount());
-        total_ms += (new_ms - ms);
-        ms = new_ms;
+int lcd_wait_flush_sequence(uint32_t sequence, uint32_t timeout) {
+    if (lcd_flush_done(sequence)) {
+        return 1;
+    }
+    TickType_t start = xTaskGetTickCount();
+    TickType_t ticks = timeout == 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeout);
+    lcd_waiter_t* waiter = NULL;
+    portENTER_CRITICAL(&lcd_wait_lock);
+    for (size_t i = 0; i < LCD_WAITERS; ++i) {
+        if (lcd_waiters[i].task == NULL) {
+            waiter = &lcd_waiters[i];
+            waiter->sequence = sequence;
+            waiter->task = xTaskGetCurrentTaskHandle();
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&lcd_wait_lock);
+    int result = 1;
+    // check again now that the callback can see us, so we can't miss it
+    while (!lcd_flush_done(sequence)) {
+        TickType_t remaining = portMAX_DELAY;
+        if (timeout != 0) {
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            if (elapsed >= ticks) {
+                result = 0;
+                break;
+            }
+            remaining = ticks - elapsed;
+        }
+        if (waiter != NULL) {
+            ulTaskNotifyTake(pdTRUE, remaining);
+        } else {
+            // every slot is taken, so poll
+            vTaskDelay(1);
+        }
     }
-    return timeout == 0 || total_ms < timeout;
+    if (waiter != NULL) {
+        portENTER_CRITICAL(&lcd_wait_lock);
+        waiter->task = NULL;
+        portEXIT_CRITICAL(&lcd_wait_lock);
+        // the callback may have notified us again after we stopped waiting
+        ulTaskNotifyTake(pdTRUE, 0);
+    }
+    return result;
+}
+int lcd_wait_flush(uint32_t timeout) {
+    return lcd_wait_flush_sequence(lcd_flush_submitted, timeout);
 }
 void lcd_on_flush_complete() {}
+static uint8_t lcd_rotation_madctl(int rotation) {
+    switch (rotation & 3) {
+        case 1:
+            return (0x40 | 0x20 | 0x08);
+        case 2:
+            return (0x40 | 0x80 | 0x08);
+        case 3:
+            return (0x20 | 0x80 | 0x08);
+        default:  // case 0:
+            return (0x08);
+    };
+}
 void lcd_rotation(int rotation) {
-    uint8_t param;
+    lcd_set_madctl(lcd_rotation_madctl(rotation));
+    lcd_rot = rotation & 3;
+}
+// map a point between the logical coordinates of a rotation and the panel's
+// native 240x320 coordinates
+static void lcd_logical_to_native(int rotation, uint16_t x, uint16_t y,
+                                  uint16_t* out_x, uint16_t* out_y) {
     switch (rotation & 3) {
         case 1:
-            param = (0x40 | 0x20 | 0x08);
+            *out_x = 240 - y - 1;
+            *out_y = x;
             break;
         case 2:
-            param = (0x40 | 0x80 | 0x08);
+            *out_x = 240 - x - 1;
+            *out_y = 320 - y - 1;
             break;
         case 3:
-            param = (0x20 | 0x80 | 0x08);
+            *out_x = y;
+            *out_y = 320 - x - 1;
             break;
-        default:  // case 0:
-            param = (0x08);
+        default:
+            *out_x = x;
+            *out_y = y;
             break;
-    };
-    lcd_command(0x36, &param, 1);
-    lcd_rot = rotation;
+    }
+}
+static void lcd_native_to_logical(int rotation, uint16_t x, uint16_t y,
+                                  uint16_t* out_x, uint16_t* out_y) {
+    switch (rotation & 3) {
+        case 1:
+            *out_x = y;
+            *out_y = 240 - x - 1;
+            break;
+        case 2:
+            *out_x = 240 - x - 1;
+            *out_y = 320 - y - 1;
+            break;
+        case 3:
+            *out_x = 320 - y - 1;
+            *out_y = x;
+            break;
+        default:
+            *out_x = x;
+            *out_y = y;
+            break;
+    }
+}
+// take a rectangle in the logical coordinates of one rotation to another
+static void lcd_rect_rotate(int from, int to, const lcd_rect_t* rect,
+                            lcd_rect_t* out_rect) {
+    uint16_t x1, y1, x2, y2;
+    lcd_logical_to_native(from, rect->x1, rect->y1, &x1, &y1);
+    lcd_native_to_logical(to, x1, y1, &x1, &y1);
+    lcd_logical_to_native(from, rect->x2, rect->y2, &x2, &y2);
+    lcd_native_to_logical(to, x2, y2, &x2, &y2);
+    out_rect->x1 = x1 < x2 ? x1 : x2;
+    out_rect->y1 = y1 < y2 ? y1 : y2;
+    out_rect->x2 = x1 < x2 ? x2 : x1;
+    out_rect->y2 = y1 < y2 ? y2 : y1;
 }
 
 void lcd_initialize(size_t max_transfer_size) {
     if (lcd_spi_handle != NULL) {
         return;
     }
-    memset(lcd_trans, 0, sizeof(spi_transaction_t) * 14);
+    memset(lcd_trans, 0, sizeof(lcd_trans));
+    lcd_trans_index = 0;
+    lcd_trans_in_flight = 0;
     gpio_config_t gpio_conf;
     gpio_conf.intr_type = GPIO_INTR_DISABLE;
     gpio_conf.mode = GPIO_MODE_OUTPUT;
@@ -251,12 +492,13 @@ void lcd_initialize(size_t max_transfer_size) {
     buscfg.quadhd_io_num = -1;
     // declare enough space for the transfer buffers + 8 bytes SPI DMA overhead
     buscfg.max_transfer_sz = max_transfer_size + 8;
+    lcd_max_transfer = max_transfer_size;
     // Initialize the SPI bus on HSPI (SPI3)
     ESP_ERROR_CHECK(spi_bus_initialize(host, &buscfg, SPI_DMA_CH_AUTO));
     spi_device_interface_config_t dev_cfg;
     memset(&dev_cfg, 0, sizeof(dev_cfg));
     dev_cfg.dummy_bits = 0;
-    dev_cfg.queue_size = 14;
+    dev_cfg.queue_size = LCD_TRANS_QUEUE_SIZE;
     dev_cfg.flags = SPI_DEVICE_NO_DUMMY | SPI_DEVICE_HALFDUPLEX;
     dev_cfg.spics_io_num = LCD_CS;
     dev_cfg.pre_cb = lcd_spi_pre_cb;
@@ -282,17 +524,191 @@ void lcd_deinitialize() {
     if (lcd_spi_handle == NULL) {
         return;
     }
+    lcd_trans_reclaim(portMAX_DELAY);
     spi_device_release_bus(lcd_spi_handle);
     ESP_ERROR_CHECK(spi_bus_remove_device(lcd_spi_handle));
     ESP_ERROR_CHECK(spi_bus_free(SPI3_HOST));
     lcd_spi_handle = NULL;
 }
+void lcd_command_stats(uint32_t* out_sent, uint32_t* out_elided, int reset) {
+    if (out_sent != NULL) {
+        *out_sent = lcd_commands_sent;
+    }
+    if (out_elided != NULL) {
+        *out_elided = lcd_commands_elided;
+    }
+    if (reset) {
+        lcd_commands_sent = 0;
+        lcd_commands_elided = 0;
+    }
+}
+// each window costs CASET, RASET and RAMWR: 5 transactions counting the
+// argument payloads. Until we've measured anything assume ~15us each at 80MHz
+#define LCD_WINDOW_TRANSACTIONS 5
+#define LCD_WINDOW_COST_DEFAULT 384
+#define LCD_DIRTY_MAX 16
+static lcd_rect_t lcd_dirty[LCD_DIRTY_MAX];
+static size_t lcd_dirty_count = 0;
+
+uint32_t lcd_window_cost(void) {
+    uint32_t cmd_ns = lcd_cost_cmd_ns;
+    uint32_t byte_ps = lcd_cost_byte_ps;
+    if (cmd_ns == 0 || byte_ps == 0) {
+        return LCD_WINDOW_COST_DEFAULT;
+    }
+    // convert the command overhead into the number of pixels we could have
+    // sent in the same time
+    return (uint32_t)(((uint64_t)cmd_ns * LCD_WINDOW_TRANSACTIONS * 1000) /
+                      (byte_ps * 2));
+}
+void lcd_dirty_add(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2) {
+    lcd_rect_t rect;
+    rect.x1 = x1 < x2 ? x1 : x2;
+    rect.y1 = y1 < y2 ? y1 : y2;
+    rect.x2 = x1 < x2 ? x2 : x1;
+    rect.y2 = y1 < y2 ? y2 : y1;
+    if (lcd_dirty_count == LCD_DIRTY_MAX) {
+        lcd_dirty_count = lcd_plan_rects(lcd_dirty, lcd_dirty_count,
+                                         LCD_DIRTY_MAX - 1, lcd_window_cost());
+    }
+    lcd_dirty[lcd_dirty_count++] = rect;
+}
+size_t lcd_dirty_plan(lcd_rect_t* out_rects, size_t max_rects) {
+    if (max_rects == 0) {
+        return 0;
+    }
+    size_t count = lcd_plan_rects(lcd_dirty, lcd_dirty_count, max_rects,
+                                  lcd_window_cost());
+    memcpy(out_rects, lcd_dirty, count * sizeof(lcd_rect_t));
+    lcd_dirty_count = 0;
+    return count;
+}
 void lcd_flush(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2,
                const void* bitmap) {
-    lcd_flushing=1;
-    lcd_set_window(x1, y1, x2, y2);
-    int w = x2 - x1 + 1, h = y2 - y1 + 1;
-    lcd_write_bitmap(bitmap, w * h);
+    lcd_region_t region;
+    region.bounds.x1 = x1;
+    region.bounds.y1 = y1;
+    region.bounds.x2 = x2;
+    region.bounds.y2 = y2;
+    region.bitmap = bitmap;
+    lcd_flush_batch(&region, 1);
+}
+static uint32_t lcd_region_pixels(const lcd_region_t* region) {
+    if (region->bitmap == NULL || region->bounds.x2 < region->bounds.x1 ||
+        region->bounds.y2 < region->bounds.y1) {
+        return 0;
+    }
+    return lcd_rect_area(&region->bounds);
+}
+// notify is 2 to call lcd_on_flush_complete() when done, or 3 not to. 0
+// queues the regions as the first part of a flush that a later call ends,
+// so they don't count as a flush of their own
+static void lcd_flush_regions(const lcd_region_t* regions, size_t count,
+                              int notify) {
+    lcd_trans_reclaim(0);
+    size_t last = count;
+    for (size_t i = 0; i < count; ++i) {
+        if (lcd_region_pixels(&regions[i])) {
+            last = i;
+        }
+    }
+    if (last == count) {
+        // nothing to send. it doesn't get a sequence number of its own, so
+        // waiting on it waits on whatever was queued before it
+        if (notify == 2) {
+            lcd_on_flush_complete();
+        }
+        return;
+    }
+    if (notify != 0) {
+        ++lcd_flush_submitted;
+    }
+    size_t i = 0;
+    while (i <= last) {
+        if (!lcd_region_pixels(&regions[i])) {
+            ++i;
+            continue;
+        }
+        // find the run of strips stacked directly below this one with the
+        // same columns. they share one window and continue the write
+        // rather than each setting up their own
+        lcd_rect_t window = regions[i].bounds;
+        size_t end = i + 1;
+        while (end <= last) {
+            const lcd_rect_t* next = &regions[end].bounds;
+            if (!lcd_region_pixels(&regions[end]) || next->x1 != window.x1 ||
+                next->x2 != window.x2 || next->y1 != window.y2 + 1) {
+                break;
+            }
+            window.y2 = next->y2;
+            ++end;
+        }
+        lcd_set_window(window.x1, window.y1, window.x2, window.y2);
+        for (size_t j = i; j < end; ++j) {
+            lcd_write_bitmap(regions[j].bitmap, lcd_region_pixels(&regions[j]),
+                             j == i ? 0x2C : 0x3C, j == last ? notify : 0);
+        }
+        i = end;
+    }
+}
+void lcd_flush_batch(const lcd_region_t* regions, size_t count) {
+    lcd_flush_regions(regions, count, 2);
+}
+static int lcd_flush_rotated_impl(uint16_t x, uint16_t y, uint16_t w,
+                                  uint16_t h, const void* bitmap, int rotation,
+                                  int notify) {
+    // rather than rotating the pixels we rotate the panel's scan direction
+    // for this window, so the rotated bitmap lands where it would have been
+    // drawn in the current rotation.
+    rotation &= 3;
+    const int rot = (lcd_rot + 4 - rotation) & 3;
+    // the window has to be on the panel, or rotating it wraps around
+    const int dst_w = (rotation & 1) ? h : w;
+    const int dst_h = (rotation & 1) ? w : h;
+    if (w == 0 || h == 0 || x + dst_w > ((lcd_rot & 1) ? 320 : 240) ||
+        y + dst_h > ((lcd_rot & 1) ? 240 : 320)) {
+        return 0;
+    }
+    lcd_rect_t dst;
+    dst.x1 = x;
+    dst.y1 = y;
+    dst.x2 = x + dst_w - 1;
+    dst.y2 = y + dst_h - 1;
+    lcd_rect_t window;
+    lcd_rect_rotate(lcd_rot, rot, &dst, &window);
+    // the bitmap may be bigger than one SPI transfer, so send it as strips
+    // in one window
+    size_t rows = lcd_max_transfer / (w * 2);
+    if (rows == 0) {
+        return 0;
+    }
+    lcd_region_t regions[16];
+    size_t count = 0;
+    const uint8_t* src = (const uint8_t*)bitmap;
+    lcd_set_madctl(lcd_rotation_madctl(rot));
+    for (uint16_t row = 0; row < h; row += rows) {
+        uint16_t strip = (h - row) < rows ? (h - row) : rows;
+        lcd_region_t* region = &regions[count++];
+        region->bounds.x1 = window.x1;
+        region->bounds.x2 = window.x2;
+        region->bounds.y1 = window.y1 + row;
+        region->bounds.y2 = window.y1 + row + strip - 1;
+        region->bitmap = src;
+        src += strip * w * 2;
+        // only the last chunk ends the flush
+        if (row + strip >= h) {
+            lcd_flush_regions(regions, count, notify);
+        } else if (count == sizeof(regions) / sizeof(regions[0])) {
+            lcd_flush_regions(regions, count, 0);
+            count = 0;
+        }
+    }
+    lcd_set_madctl(lcd_rotation_madctl(lcd_rot));
+    return 1;
+}
+int lcd_flush_rotated(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                      const void* bitmap, int rotation) {
+    return lcd_flush_rotated_impl(x, y, w, h, bitmap, rotation, 2);
 }
 static int led_initialized = 0;
 void led_enable(int value) {
@@ -324,66 +740,916 @@ static int camera_rot = 0;
 static int camera_initialized = 0;
 static int camera_flags = 0;
 static camera_fb_t* camera_current_fb = NULL;
-void camera_rotation(int rotation) { camera_rot = rotation & 3; }
-static void camera_copy_rotate(const void* bitmap, int rows, int cols) {
-    // allocating space for the new rotated image
-    const uint16_t* original = (const uint16_t*)bitmap;
-    uint16_t* out = (uint16_t*)camera_fb;
-    size_t count;
-    switch (camera_rot) {
-        case 1:
-            // rotate 90
-            for (int y = 0; y < rows; ++y) {
-                for (int x = 0; x < cols; ++x) {
-                    out[(cols - x - 1) * rows + y] = *(original++);
-                }
-            }
-            break;
-        case 2:
-            // rotate 180
-            for (int y = 0; y < rows; ++y) {
-                for (int x = 0; x < cols; ++x) {
-                    out[(rows - y - 1) * cols + (cols - x - 1)] = *(original++);
-                }
-            }
-            break;
-        case 3:
-            // rotate 270
-            for (int y = 0; y < rows; ++y) {
-                for (int x = 0; x < cols; ++x) {
-                    out[x * rows + (rows - y - 1)] = *(original++);
-                }
-            }
-            break;
-        default:  // case 0:
-            count = rows * cols;
-            while (count--) {
-                *(out++) = *(original++);
+static size_t camera_fb_count = 0;
+// the frame being sent straight to the LCD. it goes back to the camera once
+// the flush with this sequence number has gone out
+static camera_fb_t* camera_lcd_fb = NULL;
+static uint32_t camera_lcd_sequence = 0;
+// the part of the rotation the sensor does for us by flipping its readout
+static int camera_sensor_rot = 0;
+// 180 degrees is just flipping both axes, which the sensor can do for free.
+// the sensor is normally read out with vflip off and hmirror on
+static void camera_apply_rotation(void) {
+    sensor_t* s = esp_camera_sensor_get();
+    if (s == NULL) {
+        camera_sensor_rot = 0;
+        return;
+    }
+    camera_sensor_rot = camera_rot == 2 ? 2 : 0;
+    s->set_vflip(s, camera_sensor_rot == 2);
+    s->set_hmirror(s, camera_sensor_rot != 2);
+}
+// what's left of the rotation after the sensor's part
+static int camera_pixel_rotation(void) {
+    return (camera_rot + 4 - camera_sensor_rot) & 3;
+}
+void camera_rotation(int rotation) {
+    camera_rot = rotation & 3;
+    if (camera_initialized) {
+        camera_apply_rotation();
+    }
+}
+static void camera_copy_rotate(void* dst, const void* bitmap, int rows,
+                               int cols) {
+    camera_rotate((uint16_t*)dst, (const uint16_t*)bitmap, rows, cols,
+                  camera_pixel_rotation());
+}
+static int camera_frame_dim(void) {
+    return (camera_flags & CAM_FRAME_SIZE_96X96) ? 96 : 240;
+}
+
+// region of interest. width of zero means the whole frame
+typedef struct {
+    int x, y, width, height;
+    int out_width, out_height;
+} camera_roi_t;
+static camera_roi_t camera_roi_config = {0, 0, 0, 0, 0, 0};
+static portMUX_TYPE camera_roi_lock = portMUX_INITIALIZER_UNLOCKED;
+// holds the cropped frame before it's rotated
+static void* camera_roi_scratch = NULL;
+
+// RGB565 from the sensor is big endian
+#define CAMERA_R5(p) ((p)[0] >> 3)
+#define CAMERA_G6(p) ((((p)[0] & 0x07) << 3) | ((p)[1] >> 5))
+#define CAMERA_B5(p) ((p)[1] & 0x1F)
+int camera_roi(int x, int y, int width, int height, int out_width,
+               int out_height) {
+    const int dim = camera_frame_dim();
+    camera_roi_t roi = {0, 0, 0, 0, 0, 0};
+    if (width > 0 && height > 0) {
+        // the frame size isn't settled until the camera is up
+        if (!camera_initialized || x < 0 || y < 0 || x + width > dim || y + height > dim ||
+            out_width <= 0 || out_height <= 0 || out_width > width ||
+            out_height > height) {
+            return 0;
+        }
+        roi.x = x;
+        roi.y = y;
+        roi.width = width;
+        roi.height = height;
+        roi.out_width = out_width;
+        roi.out_height = out_height;
+        if (camera_roi_scratch == NULL) {
+            // big enough for any crop of the frame
+            camera_roi_scratch = heap_caps_malloc(
+                dim * dim * 2, (camera_flags & CAM_ALLOC_FB_PSRAM)
+                                   ? MALLOC_CAP_SPIRAM
+                                   : MALLOC_CAP_DEFAULT);
+            if (camera_roi_scratch == NULL) {
+                return 0;
             }
-            break;
+        }
     }
+    portENTER_CRITICAL(&camera_roi_lock);
+    camera_roi_config = roi;
+    portEXIT_CRITICAL(&camera_roi_lock);
+    return 1;
 }
+void camera_frame_size(int* out_width, int* out_height) {
+    int w = camera_frame_dim(), h = w;
+    portENTER_CRITICAL(&camera_roi_lock);
+    if (camera_roi_config.width > 0) {
+        w = camera_roi_config.out_width;
+        h = camera_roi_config.out_height;
+    }
+    portEXIT_CRITICAL(&camera_roi_lock);
+    if (camera_pixel_rotation() & 1) {
+        int tmp = w;
+        w = h;
+        h = tmp;
+    }
+    if (out_width != NULL) {
+        *out_width = w;
+    }
+    if (out_height != NULL) {
+        *out_height = h;
+    }
+}
+// BT.601 luma in 8.8 fixed point
+void camera_luma(const void* src, void* dst, size_t count) {
+    const uint8_t* in = (const uint8_t*)src;
+    uint8_t* out = (uint8_t*)dst;
+    while (count--) {
+        uint32_t r = CAMERA_R5(in), g = CAMERA_G6(in), b = CAMERA_B5(in);
+        // expand to 8 bits per channel
+        r = (r << 3) | (r >> 2);
+        g = (g << 2) | (g >> 4);
+        b = (b << 3) | (b >> 2);
+        // in may alias out, but we never write ahead of what we've read
+        *(out++) = (uint8_t)((77 * r + 150 * g + 29 * b) >> 8);
+        in += 2;
+    }
+}
+// crop, scale and rotate a frame from the camera into dst, and then reduce
+// it to luma if we've been asked to
+static void camera_process(void* dst, const camera_fb_t* fb) {
+    camera_roi_t roi;
+    portENTER_CRITICAL(&camera_roi_lock);
+    roi = camera_roi_config;
+    portEXIT_CRITICAL(&camera_roi_lock);
+    const int luma = camera_flags & CAM_OUTPUT_LUMA;
+    size_t count;
+    if (roi.width == 0) {
+        count = fb->width * fb->height;
+        if (luma && camera_pixel_rotation() == 0) {
+            // straight from the camera in one pass
+            camera_luma(fb->buf, dst, count);
+            return;
+        }
+        camera_copy_rotate(dst, fb->buf, fb->height, fb->width);
+    } else {
+        count = roi.out_width * roi.out_height;
+        if (camera_pixel_rotation() == 0) {
+            camera_crop_scale(fb->buf, fb->width, fb->height, roi.x, roi.y,
+                              roi.width, roi.height, dst, roi.out_width,
+                              roi.out_height);
+        } else {
+            camera_crop_scale(fb->buf, fb->width, fb->height, roi.x, roi.y,
+                              roi.width, roi.height, camera_roi_scratch,
+                              roi.out_width, roi.out_height);
+            camera_copy_rotate(dst, camera_roi_scratch, roi.out_height,
+                               roi.out_width);
+        }
+    }
+    if (luma) {
+        // in place, front to back
+        camera_luma(dst, dst, count);
+    }
+}
+// Frames are numbered as they come out of the driver. The sensor runs at a
+// fixed rate, so a gap of several frame periods between timestamps means it
+// captured frames we never got, and those take up sequence numbers too.
+typedef struct {
+    camera_frame_info_t info;
+    int64_t fetched_us;
+    int64_t processed_us;
+} camera_frame_t;
+static uint32_t camera_capture_sequence = 0;
+static int64_t camera_capture_last = 0;
+static int64_t camera_capture_period = 0;
+static uint32_t camera_delivered_sequence = 0;
+static int camera_delivered_any = 0;
+static camera_frame_t camera_fb_frame;
+static camera_frame_t camera_lcd_frame;
+static void camera_frame_fetched(const camera_fb_t* fb, camera_frame_t* frame) {
+    int64_t captured =
+        (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    int64_t gap = captured - camera_capture_last;
+    uint32_t periods = 1;
+    if (camera_capture_last != 0 && gap > 0) {
+        // the shortest gap we've seen is the sensor's frame period
+        if (camera_capture_period == 0 || gap < camera_capture_period) {
+            camera_capture_period = gap;
+        }
+        periods = (uint32_t)((gap + camera_capture_period / 2) /
+                             camera_capture_period);
+        if (periods < 1) {
+            periods = 1;
+        }
+    }
+    camera_capture_last = captured;
+    camera_capture_sequence += periods;
+    frame->info.timestamp_us = captured;
+    frame->info.sequence = camera_capture_sequence;
+    frame->info.dropped = 0;
+    frame->fetched_us = esp_timer_get_time();
+    frame->processed_us = frame->fetched_us;
+}
+// the frame is the caller's now, so anything before it never will be
+static void camera_frame_accepted(camera_frame_t* frame) {
+    if (camera_delivered_any) {
+        frame->info.dropped =
+            frame->info.sequence - camera_delivered_sequence - 1;
+    }
+    camera_delivered_sequence = frame->info.sequence;
+    camera_delivered_any = 1;
+}
+
+// The profiler runs on the consumer's side of the camera. It counts the frames
+// that reach the caller and the ones that never did, and buckets how long each
+// frame spends in each stage on the way.
+static portMUX_TYPE camera_profile_lock = portMUX_INITIALIZER_UNLOCKED;
+static camera_profile_t camera_profile_stats;
+static uint64_t camera_profile_latency_total = 0;
+static uint32_t camera_histogram[CAMERA_STAGE_COUNT][CAMERA_HISTOGRAM_BUCKETS];
+static void camera_histogram_add(camera_stage_t stage, int64_t us) {
+    uint32_t ms = us < 0 ? 0 : (uint32_t)(us / 1000);
+    size_t bucket = 0;
+    while (bucket < CAMERA_HISTOGRAM_BUCKETS - 1 && ms >= (1U << bucket)) {
+        ++bucket;
+    }
+    ++camera_histogram[stage][bucket];
+}
+// delivered_us is when the frame reached the caller, or the panel
+static void camera_frame_delivered(const camera_frame_t* frame,
+                                   int64_t delivered_us) {
+    int64_t captured = frame->info.timestamp_us;
+    if (!(camera_flags & CAM_PROFILE) || captured <= 0 ||
+        delivered_us < frame->processed_us) {
+        return;
+    }
+    uint32_t latency = (uint32_t)(delivered_us - captured);
+    portENTER_CRITICAL(&camera_profile_lock);
+    camera_profile_t* stats = &camera_profile_stats;
+    stats->dropped += frame->info.dropped;
+    if (stats->frames == 0 || latency < stats->latency_min_us) {
+        stats->latency_min_us = latency;
+    }
+    if (latency > stats->latency_max_us) {
+        stats->latency_max_us = latency;
+    }
+    camera_profile_latency_total += latency;
+    ++stats->frames;
+    stats->latency_avg_us =
+        (uint32_t)(camera_profile_latency_total / stats->frames);
+    camera_histogram_add(CAMERA_STAGE_CAPTURE, frame->fetched_us - captured);
+    camera_histogram_add(CAMERA_STAGE_PROCESS,
+                         frame->processed_us - frame->fetched_us);
+    camera_histogram_add(CAMERA_STAGE_DELIVER,
+                         delivered_us - frame->processed_us);
+    camera_histogram_add(CAMERA_STAGE_TOTAL, latency);
+    portEXIT_CRITICAL(&camera_profile_lock);
+}
+void camera_profile(camera_profile_t* out_profile, int reset) {
+    portENTER_CRITICAL(&camera_profile_lock);
+    if (out_profile != NULL) {
+        *out_profile = camera_profile_stats;
+    }
+    if (reset) {
+        memset(&camera_profile_stats, 0, sizeof(camera_profile_stats));
+        camera_profile_latency_total = 0;
+    }
+    portEXIT_CRITICAL(&camera_profile_lock);
+}
+void camera_latency_histogram(camera_stage_t stage, uint32_t* out_buckets,
+                              int reset) {
+    if (stage < 0 || stage >= CAMERA_STAGE_COUNT) {
+        return;
+    }
+    portENTER_CRITICAL(&camera_profile_lock);
+    if (out_buckets != NULL) {
+        memcpy(out_buckets, camera_histogram[stage],
+               sizeof(camera_histogram[stage]));
+    }
+    if (reset) {
+        memset(camera_histogram[stage], 0, sizeof(camera_histogram[stage]));
+    }
+    portEXIT_CRITICAL(&camera_profile_lock);
+}
+
+static volatile int camera_pipeline_running = 0;
 const void* camera_frame_buffer() {
-    if (!camera_initialized) {
+    if (!camera_initialized || camera_fb == NULL) {
+        return NULL;
+    }
+    if (camera_pipeline_running) {
+        // the pipeline owns the camera. use camera_acquire_frame()
         return NULL;
     }
     camera_current_fb = esp_camera_fb_get();
     if (camera_current_fb != NULL) {
-        camera_copy_rotate(camera_current_fb->buf,
-                           (camera_flags & CAM_FRAME_SIZE_96X96) ? 96 : 240,
-                           (camera_flags & CAM_FRAME_SIZE_96X96) ? 96 : 240);
+        camera_frame_fetched(camera_current_fb, &camera_fb_frame);
+        camera_process(camera_fb, camera_current_fb);
         esp_camera_fb_return(camera_current_fb);
+        camera_fb_frame.processed_us = esp_timer_get_time();
+        camera_frame_accepted(&camera_fb_frame);
+        camera_frame_delivered(&camera_fb_frame, camera_fb_frame.processed_us);
         return camera_fb;
     }
     esp_camera_fb_return(camera_current_fb);
     return NULL;
 }
 
+// Motion detection keeps a running average of the scene's luma as its
+// background, and compares each new frame to it a block at a time using the
+// sum of absolute differences. Adjacent blocks over the threshold are joined
+// into boxes.
+#define CAMERA_MOTION_MAX_BOXES 8
+static int camera_motion_block = 0;
+static int camera_motion_threshold = 0;
+static int camera_motion_width = 0;
+static int camera_motion_height = 0;
+static uint8_t* camera_motion_background = NULL;
+// per block mean difference followed by the component parents
+static uint16_t* camera_motion_blocks = NULL;
+static camera_motion_box_t* camera_motion_components = NULL;
+static camera_motion_box_t camera_motion_result[CAMERA_MOTION_MAX_BOXES];
+static size_t camera_motion_result_count = 0;
+static uint32_t camera_motion_total = 0;
+static portMUX_TYPE camera_motion_lock = portMUX_INITIALIZER_UNLOCKED;
+// held for the whole of an update, and while the state is set up or freed,
+// so the pipeline task can't be mid-update when the buffers go away. it's
+// created once and never deleted
+static SemaphoreHandle_t camera_motion_mutex = NULL;
+static StaticSemaphore_t camera_motion_mutex_buffer;
+
+static void camera_motion_free(void) {
+    if (camera_motion_background != NULL) {
+        free(camera_motion_background);
+        camera_motion_background = NULL;
+    }
+    if (camera_motion_blocks != NULL) {
+        free(camera_motion_blocks);
+        camera_motion_blocks = NULL;
+    }
+    if (camera_motion_components != NULL) {
+        free(camera_motion_components);
+        camera_motion_components = NULL;
+    }
+    camera_motion_width = 0;
+    camera_motion_height = 0;
+}
+int camera_motion_initialize(int block_size, int threshold) {
+    if (block_size < 4 || block_size > 32 || threshold < 1) {
+        return 0;
+    }
+    if (camera_motion_mutex == NULL) {
+        camera_motion_mutex =
+            xSemaphoreCreateMutexStatic(&camera_motion_mutex_buffer);
+    }
+    xSemaphoreTake(camera_motion_mutex, portMAX_DELAY);
+    camera_motion_free();
+    camera_motion_block = block_size;
+    camera_motion_threshold = threshold;
+    portENTER_CRITICAL(&camera_motion_lock);
+    camera_motion_result_count = 0;
+    camera_motion_total = 0;
+    portEXIT_CRITICAL(&camera_motion_lock);
+    xSemaphoreGive(camera_motion_mutex);
+    return 1;
+}
+void camera_motion_deinitialize(void) {
+    if (camera_motion_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(camera_motion_mutex, portMAX_DELAY);
+    camera_motion_block = 0;
+    camera_motion_free();
+    xSemaphoreGive(camera_motion_mutex);
+}
+static uint16_t camera_motion_find(uint16_t* parent, uint16_t i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+// call with camera_motion_mutex held
+static size_t camera_motion_update_locked(const void* frame, int width,
+                                          int height, int luma) {
+    const int bs = camera_motion_block;
+    if (bs == 0 || frame == NULL || width < bs || height < bs) {
+        return 0;
+    }
+    const int bw = width / bs, bh = height / bs;
+    // block indices have to fit the uint16_t component parents
+    if (bw * bh > 65535) {
+        return 0;
+    }
+    int first = 0;
+    if (width != camera_motion_width || height != camera_motion_height) {
+        camera_motion_free();
+        camera_motion_background = (uint8_t*)heap_caps_malloc(
+            width * height,
+            (camera_flags & CAM_ALLOC_FB_PSRAM) ? MALLOC_CAP_SPIRAM
+                                                : MALLOC_CAP_DEFAULT);
+        camera_motion_blocks = (uint16_t*)heap_caps_malloc(
+            bw * bh * sizeof(uint16_t) * 2, MALLOC_CAP_DEFAULT);
+        camera_motion_components = (camera_motion_box_t*)heap_caps_malloc(
+            bw * bh * sizeof(camera_motion_box_t), MALLOC_CAP_DEFAULT);
+        if (camera_motion_background == NULL || camera_motion_blocks == NULL ||
+            camera_motion_components == NULL) {
+            camera_motion_free();
+            return 0;
+        }
+        camera_motion_width = width;
+        camera_motion_height = height;
+        first = 1;
+    }
+    uint16_t* level = camera_motion_blocks;
+    uint16_t* parent = camera_motion_blocks + bw * bh;
+    uint8_t row[32];
+    uint32_t total = 0;
+    // a block row at a time, so the background and the frame stay in cache
+    for (int by = 0; by < bh; ++by) {
+        for (int bx = 0; bx < bw; ++bx) {
+            uint32_t sad = 0;
+            for (int y = 0; y < bs; ++y) {
+                const int offset = (by * bs + y) * width + bx * bs;
+                const uint8_t* cur;
+                if (luma) {
+                    cur = (const uint8_t*)frame + offset;
+                } else {
+                    camera_luma((const uint8_t*)frame + offset * 2, row, bs);
+                    cur = row;
+                }
+                uint8_t* bg = camera_motion_background + offset;
+                if (first) {
+                    memcpy(bg, cur, bs);
+                    continue;
+                }
+                for (int x = 0; x < bs; ++x) {
+                    int d = (int)cur[x] - (int)bg[x];
+                    sad += d < 0 ? -d : d;
+                    // follow the scene slowly, so lighting changes and
+                    // things that stop moving fade into the background
+                    bg[x] += d / 16 + (d > 0) - (d < 0);
+                }
+            }
+            uint16_t mean = (uint16_t)(sad / (bs * bs));
+            level[by * bw + bx] = mean;
+            total += mean;
+        }
+    }
+    // join adjacent active blocks
+    const int n = bw * bh;
+    for (int i = 0; i < n; ++i) {
+        parent[i] = (uint16_t)i;
+    }
+    for (int by = 0; by < bh; ++by) {
+        for (int bx = 0; bx < bw; ++bx) {
+            const int i = by * bw + bx;
+            if (level[i] < camera_motion_threshold) {
+                continue;
+            }
+            if (bx > 0 && level[i - 1] >= camera_motion_threshold) {
+                parent[camera_motion_find(parent, i)] =
+                    camera_motion_find(parent, i - 1);
+            }
+            if (by > 0 && level[i - bw] >= camera_motion_threshold) {
+                parent[camera_motion_find(parent, i)] =
+                    camera_motion_find(parent, i - bw);
+            }
+        }
+    }
+    // gather each component into the box at its root
+    camera_motion_box_t* components = camera_motion_components;
+    for (int i = 0; i < n; ++i) {
+        components[i].score = 0;
+    }
+    for (int i = 0; i < n; ++i) {
+        if (level[i] < camera_motion_threshold) {
+            continue;
+        }
+        camera_motion_box_t* box = &components[camera_motion_find(parent, i)];
+        const uint16_t x = (i % bw) * bs, y = (i / bw) * bs;
+        if (box->score == 0) {
+            box->x1 = x;
+            box->y1 = y;
+            box->x2 = x + bs - 1;
+            box->y2 = y + bs - 1;
+        } else {
+            if (x < box->x1) box->x1 = x;
+            if (y < box->y1) box->y1 = y;
+            if (x + bs - 1 > box->x2) box->x2 = x + bs - 1;
+            if (y + bs - 1 > box->y2) box->y2 = y + bs - 1;
+        }
+        box->score += level[i];
+    }
+    // keep the strongest, strongest first
+    camera_motion_box_t boxes[CAMERA_MOTION_MAX_BOXES];
+    size_t count = 0;
+    for (int i = 0; i < n; ++i) {
+        if (components[i].score == 0) {
+            continue;
+        }
+        size_t j = count;
+        if (count < CAMERA_MOTION_MAX_BOXES) {
+            ++count;
+        } else if (components[i].score <= boxes[count - 1].score) {
+            continue;
+        } else {
+            j = count - 1;
+        }
+        while (j > 0 && boxes[j - 1].score < components[i].score) {
+            boxes[j] = boxes[j - 1];
+            --j;
+        }
+        boxes[j] = components[i];
+    }
+    portENTER_CRITICAL(&camera_motion_lock);
+    memcpy(camera_motion_result, boxes, count * sizeof(camera_motion_box_t));
+    camera_motion_result_count = count;
+    camera_motion_total = total;
+    portEXIT_CRITICAL(&camera_motion_lock);
+    return count;
+}
+size_t camera_motion_update(const void* frame, int width, int height,
+                            int luma) {
+    if (camera_motion_mutex == NULL) {
+        return 0;
+    }
+    xSemaphoreTake(camera_motion_mutex, portMAX_DELAY);
+    size_t result = camera_motion_update_locked(frame, width, height, luma);
+    xSemaphoreGive(camera_motion_mutex);
+    return result;
+}
+size_t camera_motion_boxes(camera_motion_box_t* out_boxes, size_t max_boxes) {
+    portENTER_CRITICAL(&camera_motion_lock);
+    size_t count = camera_motion_result_count < max_boxes
+                       ? camera_motion_result_count
+                       : max_boxes;
+    memcpy(out_boxes, camera_motion_result, count * sizeof(camera_motion_box_t));
+    portEXIT_CRITICAL(&camera_motion_lock);
+    return count;
+}
+uint32_t camera_motion_score(void) { return camera_motion_total; }
+
+// The pipeline task grabs and converts frames into a small ring of buffers
+// while the caller is busy with the last one. The caller always gets the
+// newest finished frame, and anything older it never saw counts as dropped.
+#define CAMERA_PIPELINE_MAX 4
+typedef enum {
+    CAMERA_SLOT_FREE = 0,
+    CAMERA_SLOT_WRITING,
+    CAMERA_SLOT_READY,
+    CAMERA_SLOT_READING
+} camera_slot_state_t;
+typedef struct {
+    void* buffer;
+    camera_slot_state_t state;
+    uint32_t sequence;
+    camera_frame_t frame;
+} camera_slot_t;
+static camera_slot_t camera_slots[CAMERA_PIPELINE_MAX];
+static size_t camera_slot_count = 0;
+static uint32_t camera_slot_sequence = 0;
+static volatile uint32_t camera_dropped = 0;
+static SemaphoreHandle_t camera_pipeline_lock = NULL;
+static SemaphoreHandle_t camera_pipeline_ready = NULL;
+static SemaphoreHandle_t camera_pipeline_done = NULL;
+// the pipeline stays open after the task stops until every acquired frame
+// is back. users counts the calls in progress, so teardown can wait for
+// them to leave before it frees the slots and semaphores out from under them
+static int camera_pipeline_open = 0;
+static int camera_pipeline_users = 0;
+
+static int camera_pipeline_enter(void) {
+    __atomic_add_fetch(&camera_pipeline_users, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&camera_pipeline_open, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&camera_pipeline_users, 1, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+    return 1;
+}
+static void camera_pipeline_leave(void) {
+    __atomic_sub_fetch(&camera_pipeline_users, 1, __ATOMIC_SEQ_CST);
+}
+
+// returns a free slot, or failing that steals the oldest unread frame.
+// call with the lock held
+static camera_slot_t* camera_slot_for_write(void) {
+    camera_slot_t* oldest = NULL;
+    for (size_t i = 0; i < camera_slot_count; ++i) {
+        camera_slot_t* slot = &camera_slots[i];
+        if (slot->state == CAMERA_SLOT_FREE) {
+            return slot;
+        }
+        if (slot->state == CAMERA_SLOT_READY &&
+            (oldest == NULL ||
+             (int32_t)(slot->sequence - oldest->sequence) < 0)) {
+            oldest = slot;
+        }
+    }
+    if (oldest != NULL) {
+        ++camera_dropped;
+    }
+    return oldest;
+}
+static void camera_pipeline_task(void* arg) {
+    while (camera_pipeline_running) {
+        camera_fb_t* fb = esp_camera_fb_get();
+        if (fb == NULL) {
+            continue;
+        }
+        camera_frame_t frame;
+        camera_frame_fetched(fb, &frame);
+        xSemaphoreTake(camera_pipeline_lock, portMAX_DELAY);
+        camera_slot_t* slot = camera_slot_for_write();
+        if (slot != NULL) {
+            slot->state = CAMERA_SLOT_WRITING;
+        } else {
+            // every buffer is checked out
+            ++camera_dropped;
+        }
+        xSemaphoreGive(camera_pipeline_lock);
+        if (slot != NULL) {
+            camera_process(slot->buffer, fb);
+            frame.processed_us = esp_timer_get_time();
+        }
+        esp_camera_fb_return(fb);
+        if (slot != NULL) {
+            xSemaphoreTake(camera_pipeline_lock, portMAX_DELAY);
+            slot->sequence = ++camera_slot_sequence;
+            slot->frame = frame;
+            slot->state = CAMERA_SLOT_READY;
+            xSemaphoreGive(camera_pipeline_lock);
+            xSemaphoreGive(camera_pipeline_ready);
+            // readers only ever read the slot, so we can share it
+            if (camera_motion_block != 0) {
+                int w, h;
+                camera_frame_size(&w, &h);
+                camera_motion_update(slot->buffer, w, h,
+                                     camera_flags & CAM_OUTPUT_LUMA);
+            }
+        }
+    }
+    xSemaphoreGive(camera_pipeline_done);
+    vTaskDelete(NULL);
+}
+static void camera_pipeline_free(void) {
+    for (size_t i = 0; i < camera_slot_count; ++i) {
+        free(camera_slots[i].buffer);
+        camera_slots[i].buffer = NULL;
+    }
+    camera_slot_count = 0;
+    if (camera_pipeline_lock != NULL) {
+        vSemaphoreDelete(camera_pipeline_lock);
+        camera_pipeline_lock = NULL;
+    }
+    if (camera_pipeline_ready != NULL) {
+        vSemaphoreDelete(camera_pipeline_ready);
+        camera_pipeline_ready = NULL;
+    }
+    if (camera_pipeline_done != NULL) {
+        vSemaphoreDelete(camera_pipeline_done);
+        camera_pipeline_done = NULL;
+    }
+}
+int camera_pipeline_initialize(size_t buffer_count, int core) {
+    if (!camera_initialized || camera_pipeline_running ||
+        camera_pipeline_open || (camera_flags & CAM_FORMAT_JPEG)) {
+        return 0;
+    }
+    if (buffer_count < 2) {
+        buffer_count = 2;
+    } else if (buffer_count > CAMERA_PIPELINE_MAX) {
+        buffer_count = CAMERA_PIPELINE_MAX;
+    }
+    const size_t camera_size = camera_frame_dim() * camera_frame_dim() * 2;
+    memset(camera_slots, 0, sizeof(camera_slots));
+    for (camera_slot_count = 0; camera_slot_count < buffer_count;
+         ++camera_slot_count) {
+        void* buffer = heap_caps_malloc(camera_size,
+                                        (camera_flags & CAM_ALLOC_FB_PSRAM)
+                                            ? MALLOC_CAP_SPIRAM
+                                            : MALLOC_CAP_DEFAULT);
+        if (buffer == NULL) {
+            camera_pipeline_free();
+            return 0;
+        }
+        camera_slots[camera_slot_count].buffer = buffer;
+    }
+    camera_pipeline_lock = xSemaphoreCreateMutex();
+    camera_pipeline_ready = xSemaphoreCreateBinary();
+    camera_pipeline_done = xSemaphoreCreateBinary();
+    if (camera_pipeline_lock == NULL || camera_pipeline_ready == NULL ||
+        camera_pipeline_done == NULL) {
+        camera_pipeline_free();
+        return 0;
+    }
+    camera_dropped = 0;
+    camera_pipeline_running = 1;
+    __atomic_store_n(&camera_pipeline_open, 1, __ATOMIC_SEQ_CST);
+    TaskHandle_t handle = NULL;
+    xTaskCreatePinnedToCore(camera_pipeline_task, "camera_pipeline", 4096,
+                            NULL, uxTaskPriorityGet(NULL), &handle,
+                            core < 0 ? tskNO_AFFINITY : core);
+    if (handle == NULL) {
+        camera_pipeline_running = 0;
+        __atomic_store_n(&camera_pipeline_open, 0, __ATOMIC_SEQ_CST);
+        camera_pipeline_free();
+        return 0;
+    }
+    return 1;
+}
+void camera_pipeline_deinitialize(void) {
+    if (!camera_pipeline_running) {
+        return;
+    }
+    camera_pipeline_running = 0;
+    xSemaphoreTake(camera_pipeline_done, portMAX_DELAY);
+    // keep waking anyone blocked in camera_acquire_frame() so they see we're
+    // stopping, and wait for the frames still checked out to come back
+    while (1) {
+        xSemaphoreGive(camera_pipeline_ready);
+        int reading = 0;
+        xSemaphoreTake(camera_pipeline_lock, portMAX_DELAY);
+        for (size_t i = 0; i < camera_slot_count; ++i) {
+            if (camera_slots[i].state == CAMERA_SLOT_READING) {
+                reading = 1;
+            }
+        }
+        xSemaphoreGive(camera_pipeline_lock);
+        if (!reading &&
+            0 == __atomic_load_n(&camera_pipeline_users, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+        vTaskDelay(1);
+    }
+    // nobody new gets in now, but someone may have got in just before
+    __atomic_store_n(&camera_pipeline_open, 0, __ATOMIC_SEQ_CST);
+    while (0 != __atomic_load_n(&camera_pipeline_users, __ATOMIC_SEQ_CST)) {
+        xSemaphoreGive(camera_pipeline_ready);
+        vTaskDelay(1);
+    }
+    camera_pipeline_free();
+}
+const void* camera_acquire_frame(uint32_t timeout) {
+    if (!camera_pipeline_enter()) {
+        return NULL;
+    }
+    TickType_t start = xTaskGetTickCount();
+    while (1) {
+        xSemaphoreTake(camera_pipeline_lock, portMAX_DELAY);
+        if (!camera_pipeline_running) {
+            xSemaphoreGive(camera_pipeline_lock);
+            camera_pipeline_leave();
+            return NULL;
+        }
+        camera_slot_t* newest = NULL;
+        for (size_t i = 0; i < camera_slot_count; ++i) {
+            camera_slot_t* slot = &camera_slots[i];
+            if (slot->state == CAMERA_SLOT_READY &&
+                (newest == NULL ||
+                 (int32_t)(slot->sequence - newest->sequence) > 0)) {
+                newest = slot;
+            }
+        }
+        if (newest != NULL) {
+            // anything older than this will never be seen
+            for (size_t i = 0; i < camera_slot_count; ++i) {
+                camera_slot_t* slot = &camera_slots[i];
+                if (slot != newest && slot->state == CAMERA_SLOT_READY) {
+                    slot->state = CAMERA_SLOT_FREE;
+                    ++camera_dropped;
+                }
+            }
+            newest->state = CAMERA_SLOT_READING;
+            camera_frame_accepted(&newest->frame);
+            camera_frame_t frame = newest->frame;
+            void* result = newest->buffer;
+            xSemaphoreGive(camera_pipeline_lock);
+            camera_pipeline_leave();
+            camera_frame_delivered(&frame, esp_timer_get_time());
+            return result;
+        }
+        xSemaphoreGive(camera_pipeline_lock);
+        TickType_t wait = portMAX_DELAY;
+        if (timeout != 0) {
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            if (elapsed >= pdMS_TO_TICKS(timeout)) {
+                camera_pipeline_leave();
+                return NULL;
+            }
+            wait = pdMS_TO_TICKS(timeout) - elapsed;
+        }
+        xSemaphoreTake(camera_pipeline_ready, wait);
+    }
+}
+void camera_release_frame(const void* frame) {
+    if (frame == NULL || !camera_pipeline_enter()) {
+        return;
+    }
+    xSemaphoreTake(camera_pipeline_lock, portMAX_DELAY);
+    for (size_t i = 0; i < camera_slot_count; ++i) {
+        if (camera_slots[i].buffer == frame) {
+            camera_slots[i].state = CAMERA_SLOT_FREE;
+            break;
+        }
+    }
+    xSemaphoreGive(camera_pipeline_lock);
+    camera_pipeline_leave();
+}
+uint32_t camera_dropped_frames(int reset) {
+    uint32_t result = camera_dropped;
+    if (reset) {
+        camera_dropped = 0;
+    }
+    return result;
+}
+
+static void camera_lcd_release(void) {
+    if (camera_lcd_fb != NULL) {
+        lcd_wait_flush_sequence(camera_lcd_sequence, 0);
+        // for us, a frame is delivered once it's on the panel
+        camera_frame_delivered(&camera_lcd_frame,
+                               lcd_flush_time(camera_lcd_sequence));
+        esp_camera_fb_return(camera_lcd_fb);
+        camera_lcd_fb = NULL;
+    }
+}
+int camera_lcd_flush(uint16_t x, uint16_t y) {
+    if (!camera_initialized || camera_pipeline_running ||
+        (camera_flags & CAM_FORMAT_JPEG) || lcd_spi_handle == NULL) {
+        return 0;
+    }
+    if (camera_fb_count < 2) {
+        // we're holding the only frame buffer, so the camera can't fill
+        // another until we give it back
+        camera_lcd_release();
+    }
+    camera_fb_t* fb = esp_camera_fb_get();
+    // while we waited on the camera the last frame was going out over SPI
+    camera_lcd_release();
+    if (fb == NULL) {
+        return 0;
+    }
+    camera_frame_t frame;
+    camera_frame_fetched(fb, &frame);
+    // the sensor's RGB565 byte order already matches the panel's
+    if (!lcd_flush_rotated_impl(x, y, fb->width, fb->height, fb->buf,
+                                camera_pixel_rotation(), 3)) {
+        esp_camera_fb_return(fb);
+        return 0;
+    }
+    frame.processed_us = esp_timer_get_time();
+    camera_frame_accepted(&frame);
+    camera_lcd_frame = frame;
+    camera_lcd_fb = fb;
+    camera_lcd_sequence = lcd_flush_sequence();
+    return 1;
+}
+int camera_frame_info(const void* frame, camera_frame_info_t* out_info) {
+    if (!camera_initialized || out_info == NULL) {
+        return 0;
+    }
+    if (frame == NULL) {
+        if (camera_lcd_frame.info.sequence == 0) {
+            return 0;
+        }
+        *out_info = camera_lcd_frame.info;
+        return 1;
+    }
+    if (frame == camera_fb && !camera_pipeline_running) {
+        *out_info = camera_fb_frame.info;
+        return 1;
+    }
+    int result = 0;
+    if (camera_pipeline_enter()) {
+        xSemaphoreTake(camera_pipeline_lock, portMAX_DELAY);
+        for (size_t i = 0; i < camera_slot_count; ++i) {
+            if (camera_slots[i].buffer == frame &&
+                camera_slots[i].state == CAMERA_SLOT_READING) {
+                *out_info = camera_slots[i].frame.info;
+                result = 1;
+                break;
+            }
+        }
+        xSemaphoreGive(camera_pipeline_lock);
+        camera_pipeline_leave();
+    }
+    return result;
+}
+
+void camera_default_settings(int flags, camera_settings_t* out_settings) {
+    int psram = 0 != (flags & CAM_ALLOC_CAM_PSRAM);
+    out_settings->fb_count = psram ? 6 : 2;
+    out_settings->grab_latest = 1;
+    out_settings->xclk_hz = CAM_SPEED;
+    out_settings->fb_in_psram = psram;
+    out_settings->jpeg_quality = 10;
+}
 void camera_initialize(int flags) {
+    camera_settings_t settings;
+    camera_default_settings(flags, &settings);
+    camera_initialize_settings(flags, &settings);
+}
+void camera_initialize_settings(int flags, const camera_settings_t* settings) {
     if (camera_initialized) {
         return;
     }
     camera_flags = flags;
+    camera_capture_sequence = 0;
+    camera_capture_last = 0;
+    camera_capture_period = 0;
+    camera_delivered_any = 0;
+    memset(&camera_fb_frame, 0, sizeof(camera_fb_frame));
+    memset(&camera_lcd_frame, 0, sizeof(camera_lcd_frame));
+    camera_profile(NULL, 1);
+    for (int i = 0; i < CAMERA_STAGE_COUNT; ++i) {
+        camera_latency_histogram((camera_stage_t)i, NULL, 1);
+    }
     camera_config_t config;
     memset(&config, 0, sizeof(config));
     config.ledc_channel = LEDC_CHANNEL_0;
@@ -404,23 +1670,30 @@ void camera_initialize(int flags) {
     config.pin_sccb_scl = CAM_SIOC;
     config.pin_pwdn = CAM_PWDN;
     config.pin_reset = CAM_RST;
-    config.xclk_freq_hz = CAM_SPEED;
+    config.xclk_freq_hz = settings->xclk_hz;
     config.frame_size = 0 != (flags & CAM_FRAME_SIZE_96X96) ? FRAMESIZE_96X96
                                                             : FRAMESIZE_240X240;
-    config.pixel_format = PIXFORMAT_RGB565;
-    config.grab_mode = CAMERA_GRAB_LATEST;
-    config.fb_location = 0 != (flags & CAM_ALLOC_CAM_PSRAM) ? CAMERA_FB_IN_PSRAM
-                                                            : CAMERA_FB_IN_DRAM;
-    config.jpeg_quality = 10;
-    config.fb_count = CAMERA_FB_IN_PSRAM ? 6 : 2;
+    config.pixel_format =
+        (flags & CAM_FORMAT_JPEG) ? PIXFORMAT_JPEG : PIXFORMAT_RGB565;
+    config.grab_mode =
+        settings->grab_latest ? CAMERA_GRAB_LATEST : CAMERA_GRAB_WHEN_EMPTY;
+    config.fb_location =
+        settings->fb_in_psram ? CAMERA_FB_IN_PSRAM : CAMERA_FB_IN_DRAM;
+    config.jpeg_quality = settings->jpeg_quality;
+    config.fb_count = settings->fb_count;
+    camera_fb_count = config.fb_count;
     ESP_ERROR_CHECK(esp_camera_init(&config));
     sensor_t* s = esp_camera_sensor_get();
     // initial sensors are flipped vertically and colors are a bit saturated
-    s->set_vflip(s, 0);       // flip it back
-    s->set_hmirror(s, 1);     // horizontal mirror image
+    // so flip it back, mirror it, and apply any 180 degree rotation
+    camera_apply_rotation();
     s->set_brightness(s, 0);  // up the brightness just a bit
     s->set_saturation(s, 0);  // lower the saturation
     camera_initialized = 1;
+    if (flags & (CAM_DIRECT_LCD | CAM_FORMAT_JPEG)) {
+        // frames go straight from the camera to the LCD or the SD
+        return;
+    }
     const size_t camera_size =
         (flags & CAM_FRAME_SIZE_96X96) ? 96 * 96 * 2 : 240 * 240 * 2;
     camera_fb = heap_caps_malloc(camera_size, (flags & CAM_ALLOC_FB_PSRAM)
@@ -450,6 +1723,16 @@ void camera_deinitialize() {
     if (!camera_initialized) {
         return;
     }
+    // the recorder's task is still pulling frames from the camera
+    camera_record_stop();
+    camera_pipeline_deinitialize();
+    camera_motion_deinitialize();
+    camera_lcd_release();
+    camera_roi(0, 0, 0, 0, 0, 0);
+    if (camera_roi_scratch != NULL) {
+        free(camera_roi_scratch);
+        camera_roi_scratch = NULL;
+    }
     camera_current_fb = NULL;
     camera_initialized = 0;
     esp_camera_deinit();
@@ -459,57 +1742,330 @@ void camera_deinitialize() {
     }
 }
 
+// The NeoPixel task owns the I2S channel. Callers set colors and poke the
+// task, which encodes them into its back buffer, swaps it to the front and
+// clocks it out, so nobody but the task ever waits on the LEDs. The lock only
+// covers a few bytes at a time: the easing and encoding run outside it, and
+// the front and back buffers belong to the task alone.
+// The DMA ring is sized to hold the whole chain and its latch, so each frame
+// is preloaded before the channel starts and can't be split by a late write.
+// The channel only runs while a frame goes out.
+#define NEOPIXEL_LED_SIZE 12
+#define NEOPIXEL_FRAME_MS 20
+// I2S frames per DMA buffer, at 4 bytes each. the driver's limit is 4092
+// bytes
+#define NEOPIXEL_DMA_FRAMES 1023
+// bit clock: 16 bit stereo at 93650 Hz, so a byte is 2 LED bits
+#define NEOPIXEL_BIT_RATE (93650 * 32)
+typedef struct {
+    neopixel_keyframe_t keyframes[NEOPIXEL_MAX_KEYFRAMES];
+    size_t count;
+    int loop;
+    int64_t start;
+    uint8_t from[3];
+} neopixel_animation_t;
 static i2s_chan_handle_t neopixel_handle = NULL;
-static uint8_t neopixel_out_buffer[12] = {0};
 static uint8_t neopixel_zero_buffer[48] = {0};
+static size_t neopixel_count = 0;
+static uint8_t* neopixel_colors = NULL;
+static uint8_t* neopixel_front = NULL;
+static uint8_t* neopixel_back = NULL;
+static int neopixel_pending = 0;
+static portMUX_TYPE neopixel_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t neopixel_task_handle = NULL;
+static SemaphoreHandle_t neopixel_task_done = NULL;
+static volatile int neopixel_running = 0;
+static neopixel_animation_t neopixel_animation;
+// bumped whenever the animation is started, stopped or overridden, so the
+// task knows to take a fresh copy, and not to publish a stale frame
+static uint32_t neopixel_animation_changes = 0;
 
 static const uint16_t neopixel_bit_patterns[4] = {0x88, 0x8e, 0xe8, 0xee};
 
-void neopixel_color(uint8_t r, uint8_t g, uint8_t b) {
+static void neopixel_encode(uint8_t* out, uint8_t r, uint8_t g, uint8_t b) {
     uint32_t red = r, green = g, blue = b;
 
-    neopixel_out_buffer[0] = neopixel_bit_patterns[green >> 6 & 0x03];
-    neopixel_out_buffer[1] = neopixel_bit_patterns[green >> 4 & 0x03];
-    neopixel_out_buffer[2] = neopixel_bit_patterns[green >> 2 & 0x03];
-    neopixel_out_buffer[3] = neopixel_bit_patterns[green & 0x03];
-
-    neopixel_out_buffer[4] = neopixel_bit_patterns[red >> 6 & 0x03];
-    neopixel_out_buffer[5] = neopixel_bit_patterns[red >> 4 & 0x03];
-    neopixel_out_buffer[6] = neopixel_bit_patterns[red >> 2 & 0x03];
-    neopixel_out_buffer[7] = neopixel_bit_patterns[red & 0x03];
-
-    neopixel_out_buffer[8] = neopixel_bit_patterns[blue >> 6 & 0x03];
-    neopixel_out_buffer[9] = neopixel_bit_patterns[blue >> 4 & 0x03];
-    neopixel_out_buffer[10] = neopixel_bit_patterns[blue >> 2 & 0x03];
-    neopixel_out_buffer[11] = neopixel_bit_patterns[blue & 0x03];
+    out[0] = neopixel_bit_patterns[green >> 6 & 0x03];
+    out[1] = neopixel_bit_patterns[green >> 4 & 0x03];
+    out[2] = neopixel_bit_patterns[green >> 2 & 0x03];
+    out[3] = neopixel_bit_patterns[green & 0x03];
+
+    out[4] = neopixel_bit_patterns[red >> 6 & 0x03];
+    out[5] = neopixel_bit_patterns[red >> 4 & 0x03];
+    out[6] = neopixel_bit_patterns[red >> 2 & 0x03];
+    out[7] = neopixel_bit_patterns[red & 0x03];
+
+    out[8] = neopixel_bit_patterns[blue >> 6 & 0x03];
+    out[9] = neopixel_bit_patterns[blue >> 4 & 0x03];
+    out[10] = neopixel_bit_patterns[blue >> 2 & 0x03];
+    out[11] = neopixel_bit_patterns[blue & 0x03];
+}
+// call with the lock held
+static void neopixel_set_locked(size_t index, uint8_t r, uint8_t g,
+                                uint8_t b) {
+    uint8_t* color = neopixel_colors + index * 3;
+    color[0] = r;
+    color[1] = g;
+    color[2] = b;
+}
+void neopixel_set(size_t index, uint8_t r, uint8_t g, uint8_t b) {
+    if (neopixel_handle == NULL || index >= neopixel_count) {
+        return;
+    }
+    portENTER_CRITICAL(&neopixel_lock);
+    neopixel_set_locked(index, r, g, b);
+    portEXIT_CRITICAL(&neopixel_lock);
+}
+void neopixel_show(void) {
+    if (neopixel_handle == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&neopixel_lock);
+    neopixel_pending = 1;
+    portEXIT_CRITICAL(&neopixel_lock);
+    xTaskNotifyGive(neopixel_task_handle);
+}
+void neopixel_color(uint8_t r, uint8_t g, uint8_t b) {
+    if (neopixel_handle == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&neopixel_lock);
+    neopixel_animation.count = 0;
+    ++neopixel_animation_changes;
+    portEXIT_CRITICAL(&neopixel_lock);
+    // an LED at a time, so a long chain doesn't hold the lock
+    for (size_t i = 0; i < neopixel_count; ++i) {
+        portENTER_CRITICAL(&neopixel_lock);
+        neopixel_set_locked(i, r, g, b);
+        portEXIT_CRITICAL(&neopixel_lock);
+    }
+    neopixel_show();
+}
+static uint8_t neopixel_lerp(uint8_t from, uint8_t to, float t) {
+    return (uint8_t)(from + ((int)to - from) * t + .5f);
+}
+static float neopixel_ease(int easing, float t) {
+    switch (easing) {
+        case NEOPIXEL_EASE_IN:
+            return t * t;
+        case NEOPIXEL_EASE_OUT:
+            return t * (2 - t);
+        case NEOPIXEL_EASE_IN_OUT:
+            return t * t * (3 - 2 * t);
+        case NEOPIXEL_EASE_STEP:
+            return t < 1 ? 0 : 1;
+        default:
+            return t;
+    }
+}
+// advance a copy of the animation to now and put its color in out_rgb.
+// returns 0 once it's over
+static int neopixel_animate_frame(neopixel_animation_t* animation,
+                                  int64_t now, uint8_t* out_rgb) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < animation->count; ++i) {
+        total += animation->keyframes[i].duration_ms * 1000ULL;
+    }
+    uint64_t elapsed = (uint64_t)(now - animation->start);
+    if (animation->loop && total > 0 && elapsed >= total) {
+        // every lap after the first starts from the last keyframe
+        const neopixel_keyframe_t* last =
+            &animation->keyframes[animation->count - 1];
+        animation->from[0] = last->r;
+        animation->from[1] = last->g;
+        animation->from[2] = last->b;
+        animation->start += (elapsed / total) * total;
+        elapsed %= total;
+    }
+    const uint8_t* from = animation->from;
+    for (size_t i = 0; i < animation->count; ++i) {
+        const neopixel_keyframe_t* key = &animation->keyframes[i];
+        uint64_t duration = key->duration_ms * 1000ULL;
+        if (elapsed < duration) {
+            float t = neopixel_ease(key->easing, (float)elapsed / duration);
+            out_rgb[0] = neopixel_lerp(from[0], key->r, t);
+            out_rgb[1] = neopixel_lerp(from[1], key->g, t);
+            out_rgb[2] = neopixel_lerp(from[2], key->b, t);
+            return 1;
+        }
+        elapsed -= duration;
+        from = &key->r;
+    }
+    // land exactly on the last one
+    memcpy(out_rgb, from, 3);
+    return 0;
+}
+int neopixel_animate(const neopixel_keyframe_t* keyframes, size_t count,
+                     int loop) {
+    if (neopixel_handle == NULL || count == 0 ||
+        count > NEOPIXEL_MAX_KEYFRAMES) {
+        return 0;
+    }
+    portENTER_CRITICAL(&neopixel_lock);
+    memcpy(neopixel_animation.keyframes, keyframes,
+           count * sizeof(neopixel_keyframe_t));
+    neopixel_animation.count = count;
+    neopixel_animation.loop = loop;
+    // start from wherever the first LED is now
+    memcpy(neopixel_animation.from, neopixel_colors, 3);
+    neopixel_animation.start = esp_timer_get_time();
+    ++neopixel_animation_changes;
+    portEXIT_CRITICAL(&neopixel_lock);
+    xTaskNotifyGive(neopixel_task_handle);
+    return 1;
+}
+void neopixel_stop(void) {
+    if (neopixel_handle == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&neopixel_lock);
+    neopixel_animation.count = 0;
+    ++neopixel_animation_changes;
+    portEXIT_CRITICAL(&neopixel_lock);
+}
+static void neopixel_send(size_t size) {
+    size_t loaded = 0;
+    i2s_channel_preload_data(neopixel_handle, neopixel_front, size, &loaded);
+    size_t zeros = 0;
+    i2s_channel_preload_data(neopixel_handle, neopixel_zero_buffer,
+                             sizeof(neopixel_zero_buffer), &zeros);
     i2s_channel_enable(neopixel_handle);
-    i2s_channel_write(neopixel_handle, neopixel_out_buffer,
-                      sizeof(neopixel_out_buffer), NULL, portMAX_DELAY);
-    i2s_channel_write(neopixel_handle, neopixel_zero_buffer,
-                      sizeof(neopixel_zero_buffer), NULL, portMAX_DELAY);
-    vTaskDelay(pdMS_TO_TICKS(10));
+    if (loaded < size || zeros < sizeof(neopixel_zero_buffer)) {
+        // the ring holds it all, so this shouldn't happen
+        i2s_channel_write(neopixel_handle, neopixel_front + loaded,
+                          size - loaded, NULL, portMAX_DELAY);
+        i2s_channel_write(neopixel_handle, neopixel_zero_buffer + zeros,
+                          sizeof(neopixel_zero_buffer) - zeros, NULL,
+                          portMAX_DELAY);
+    }
+    // let it clock out. auto_clear has zeroed each buffer as it went, so
+    // nothing stale follows next time
+    const uint32_t us = (uint32_t)((size + sizeof(neopixel_zero_buffer)) *
+                                   8ULL * 1000000 / NEOPIXEL_BIT_RATE);
+    vTaskDelay(pdMS_TO_TICKS(us / 1000) + 1);
     i2s_channel_disable(neopixel_handle);
 }
-
-void neopixel_initialize() {
+static void neopixel_task(void* arg) {
+    size_t size = neopixel_count * NEOPIXEL_LED_SIZE;
+    // the task's own copy of the animation, refreshed when it changes
+    static neopixel_animation_t animation;
+    uint32_t changes = 0;
+    while (neopixel_running) {
+        TickType_t wait = portMAX_DELAY;
+        portENTER_CRITICAL(&neopixel_lock);
+        if (changes != neopixel_animation_changes) {
+            changes = neopixel_animation_changes;
+            animation.count = neopixel_animation.count;
+            if (animation.count > 0) {
+                animation = neopixel_animation;
+            }
+        }
+        int pending = neopixel_pending;
+        neopixel_pending = 0;
+        portEXIT_CRITICAL(&neopixel_lock);
+        if (animation.count > 0) {
+            uint8_t rgb[3];
+            const int more =
+                neopixel_animate_frame(&animation, esp_timer_get_time(), rgb);
+            if (more) {
+                wait = pdMS_TO_TICKS(NEOPIXEL_FRAME_MS);
+            } else {
+                animation.count = 0;
+            }
+            // so partial updates and the next animation start from here.
+            // an LED at a time, and not over anything newer
+            for (size_t i = 0; i < neopixel_count; ++i) {
+                portENTER_CRITICAL(&neopixel_lock);
+                if (changes == neopixel_animation_changes) {
+                    neopixel_set_locked(i, rgb[0], rgb[1], rgb[2]);
+                    if (i == 0) {
+                        // carry the lap over, and let it end
+                        neopixel_animation.start = animation.start;
+                        memcpy(neopixel_animation.from, animation.from, 3);
+                        neopixel_animation.count = animation.count;
+                    }
+                }
+                portEXIT_CRITICAL(&neopixel_lock);
+            }
+            pending = 1;
+        }
+        if (pending) {
+            for (size_t i = 0; i < neopixel_count; ++i) {
+                uint8_t rgb[3];
+                portENTER_CRITICAL(&neopixel_lock);
+                memcpy(rgb, neopixel_colors + i * 3, 3);
+                portEXIT_CRITICAL(&neopixel_lock);
+                neopixel_encode(neopixel_back + i * NEOPIXEL_LED_SIZE, rgb[0],
+                                rgb[1], rgb[2]);
+            }
+            // only the task touches these, so no lock
+            uint8_t* tmp = neopixel_front;
+            neopixel_front = neopixel_back;
+            neopixel_back = tmp;
+            neopixel_send(size);
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+    xSemaphoreGive(neopixel_task_done);
+    vTaskDelete(NULL);
+}
+static void neopixel_free(void) {
+    free(neopixel_colors);
+    neopixel_colors = NULL;
+    free(neopixel_front);
+    neopixel_front = NULL;
+    free(neopixel_back);
+    neopixel_back = NULL;
+    if (neopixel_task_done != NULL) {
+        vSemaphoreDelete(neopixel_task_done);
+        neopixel_task_done = NULL;
+    }
     if (neopixel_handle != NULL) {
+        i2s_channel_disable(neopixel_handle);
+        i2s_del_channel(neopixel_handle);
+        neopixel_handle = NULL;
+    }
+}
+void neopixel_initialize() { neopixel_initialize_chain(1); }
+void neopixel_initialize_chain(size_t count) {
+    if (neopixel_handle != NULL || count == 0) {
         return;
     }
+    neopixel_count = count;
+    neopixel_colors = (uint8_t*)calloc(count, 3);
+    neopixel_front = (uint8_t*)heap_caps_calloc(count, NEOPIXEL_LED_SIZE,
+                                                MALLOC_CAP_DMA);
+    neopixel_back = (uint8_t*)heap_caps_calloc(count, NEOPIXEL_LED_SIZE,
+                                               MALLOC_CAP_DMA);
+    neopixel_task_done = xSemaphoreCreateBinary();
+    if (neopixel_colors == NULL || neopixel_front == NULL ||
+        neopixel_back == NULL || neopixel_task_done == NULL) {
+        neopixel_free();
+        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        neopixel_encode(neopixel_back + i * NEOPIXEL_LED_SIZE, 0, 0, 0);
+    }
 
     i2s_chan_config_t chan_cfg;
     memset(&chan_cfg, 0, sizeof(chan_cfg));
     chan_cfg.id = I2S_NUM_1;
     chan_cfg.role = I2S_ROLE_MASTER;
-    chan_cfg.dma_desc_num = 4;
-    chan_cfg.dma_frame_num = sizeof(neopixel_out_buffer);
-    chan_cfg.auto_clear = 0;
+    // the chain and its latch in whole I2S frames, with a buffer to spare
+    const size_t frames =
+        (count * NEOPIXEL_LED_SIZE + sizeof(neopixel_zero_buffer) + 3) / 4;
+    chan_cfg.dma_frame_num =
+        frames < NEOPIXEL_DMA_FRAMES ? frames : NEOPIXEL_DMA_FRAMES;
+    chan_cfg.dma_desc_num =
+        (frames + chan_cfg.dma_frame_num - 1) / chan_cfg.dma_frame_num + 1;
+    // send zeros whenever we've nothing queued, which latches the LEDs
+    chan_cfg.auto_clear = 1;
     chan_cfg.intr_priority = 0;
 
     i2s_new_channel(&chan_cfg, &neopixel_handle, NULL);
-
     i2s_std_config_t std_cfg;
     memset(&std_cfg, 0, sizeof(std_cfg));
-    std_cfg.clk_cfg.sample_rate_hz = 93650;
+    std_cfg.clk_cfg.sample_rate_hz = NEOPIXEL_BIT_RATE / 32;
     std_cfg.clk_cfg.clk_src = I2S_CLK_SRC_PLL_160M;
     std_cfg.clk_cfg.mclk_multiple = 128;
     std_cfg.gpio_cfg.bclk = I2S_GPIO_UNUSED;
@@ -528,21 +2084,306 @@ void neopixel_initialize() {
     std_cfg.slot_cfg.big_endian = 0;
     std_cfg.slot_cfg.bit_order_lsb = 0;
     i2s_channel_init_std_mode(neopixel_handle, &std_cfg);
+    // the task enables it for each frame
+    neopixel_pending = 1;
+    neopixel_running = 1;
+    xTaskCreate(neopixel_task, "neopixel", 2048, NULL, uxTaskPriorityGet(NULL),
+                &neopixel_task_handle);
+    if (neopixel_task_handle == NULL) {
+        neopixel_running = 0;
+        neopixel_free();
+        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
 }
 
 void neopixel_deinitialize() {
     if (neopixel_handle == NULL) {
         return;
     }
-    i2s_channel_disable(neopixel_handle);
-    i2s_del_channel(neopixel_handle);
-    neopixel_handle = NULL;
+    neopixel_running = 0;
+    xTaskNotifyGive(neopixel_task_handle);
+    xSemaphoreTake(neopixel_task_done, portMAX_DELAY);
+    neopixel_task_handle = NULL;
+    neopixel_animation.count = 0;
+    ++neopixel_animation_changes;
+    neopixel_free();
 };
 
+// The bus task owns I2C_NUM_0. Everyone else hands it write-then-read
+// requests on one of three priority queues, and it works through them highest
+// first, all through one preallocated command link. The queues, batching and
+// stats are the core's i2c_bus_sched_t, and this is the executor behind it.
+#if CONFIG_SCCB_HARDWARE_I2C_DRIVER_NEW
+// the new driver can't chain separate transfers, so each goes on its own
+#define I2C_BUS_BATCH 1
+#else
+// requests queued back to back for the same device go out as one command
+// link, joined by repeated starts, so the bus is set up and stopped once
+#define I2C_BUS_BATCH 4
+#endif
+static i2c_bus_sched_t i2c_bus_sched;
+// guards i2c_bus_sched
+static portMUX_TYPE i2c_bus_lock = portMUX_INITIALIZER_UNLOCKED;
+// given once for every request queued
+static SemaphoreHandle_t i2c_bus_pending = NULL;
+#if CONFIG_SCCB_HARDWARE_I2C_DRIVER_NEW
+static i2c_master_bus_handle_t i2c_bus_handle = NULL;
+// devices are added to the bus the first time they're addressed
+static i2c_master_dev_handle_t i2c_bus_handles[I2C_BUS_DEVICES];
+static uint8_t i2c_bus_handle_addresses[I2C_BUS_DEVICES];
+#else
+static uint8_t i2c_bus_link[I2C_LINK_RECOMMENDED_SIZE(2 * I2C_BUS_BATCH)];
+#endif
+
+#if CONFIG_SCCB_HARDWARE_I2C_DRIVER_NEW
+static i2c_master_dev_handle_t i2c_bus_device(uint8_t address) {
+    for (size_t i = 0; i < I2C_BUS_DEVICES; ++i) {
+        if (i2c_bus_handles[i] == NULL) {
+            i2c_device_config_t config;
+            memset(&config, 0, sizeof(config));
+            config.dev_addr_length = I2C_ADDR_BIT_LEN_7;
+            config.device_address = address;
+            config.scl_speed_hz = I2C_SPEED;
+            if (ESP_OK != i2c_master_bus_add_device(i2c_bus_handle, &config,
+                                                    &i2c_bus_handles[i])) {
+                i2c_bus_handles[i] = NULL;
+                return NULL;
+            }
+            i2c_bus_handle_addresses[i] = address;
+            return i2c_bus_handles[i];
+        }
+        if (i2c_bus_handle_addresses[i] == address) {
+            return i2c_bus_handles[i];
+        }
+    }
+    return NULL;
+}
+static esp_err_t i2c_bus_execute_one(const i2c_bus_request_t* request) {
+    i2c_master_dev_handle_t device = i2c_bus_device(request->address);
+    if (device == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (request->write_len > 0 && request->read_len > 0) {
+        return i2c_master_transmit_receive(device, request->write,
+                                           request->write_len, request->read,
+                                           request->read_len, request->timeout);
+    }
+    if (request->write_len > 0) {
+        return i2c_master_transmit(device, request->write, request->write_len,
+                                   request->timeout);
+    }
+    return i2c_master_receive(device, request->read, request->read_len,
+                              request->timeout);
+}
+static void i2c_bus_execute(const i2c_bus_request_t* requests, size_t count,
+                            int* out_results, void* state) {
+    for (size_t i = 0; i < count; ++i) {
+        out_results[i] = i2c_bus_execute_one(&requests[i]);
+    }
+}
+#else
+// add a request to the link, less the stop
+static esp_err_t i2c_bus_link_add(i2c_cmd_handle_t cmd,
+                                  const i2c_bus_request_t* request) {
+    esp_err_t ret = ESP_OK;
+    if (request->write_len > 0) {
+        ret = i2c_master_start(cmd);
+        if (ret == ESP_OK) {
+            ret = i2c_master_write_byte(
+                cmd, (request->address << 1) | I2C_MASTER_WRITE, true);
+        }
+        if (ret == ESP_OK) {
+            ret = i2c_master_write(cmd, request->write, request->write_len,
+                                   true);
+        }
+    }
+    if (ret == ESP_OK && request->read_len > 0) {
+        // a repeated start if we wrote first
+        ret = i2c_master_start(cmd);
+        if (ret == ESP_OK) {
+            ret = i2c_master_write_byte(
+                cmd, (request->address << 1) | I2C_MASTER_READ, true);
+        }
+        if (ret == ESP_OK) {
+            ret = i2c_master_read(cmd, request->read, request->read_len,
+                                  I2C_MASTER_LAST_NACK);
+        }
+    }
+    return ret;
+}
+// the whole batch succeeds or fails together. i2c_bus_sched_execute() then
+// retries a failed one a request at a time
+static void i2c_bus_execute(const i2c_bus_request_t* requests, size_t count,
+                            int* out_results, void* state) {
+    esp_err_t ret = ESP_ERR_NO_MEM;
+    i2c_cmd_handle_t cmd =
+        i2c_cmd_link_create_static(i2c_bus_link, sizeof(i2c_bus_link));
+    if (cmd != NULL) {
+        ret = ESP_OK;
+        uint32_t timeout = 0;
+        for (size_t i = 0; i < count && ret == ESP_OK; ++i) {
+            // each start after the first is a repeated start
+            ret = i2c_bus_link_add(cmd, &requests[i]);
+            if (requests[i].timeout > timeout) {
+                timeout = requests[i].timeout;
+            }
+        }
+        if (ret == ESP_OK) {
+            ret = i2c_master_stop(cmd);
+        }
+        if (ret == ESP_OK) {
+            ret = i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(timeout));
+        }
+        i2c_cmd_link_delete_static(cmd);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        out_results[i] = ret;
+    }
+}
+#endif
+static void i2c_bus_task(void* arg) {
+    while (1) {
+        xSemaphoreTake(i2c_bus_pending, portMAX_DELAY);
+        // every give matches a request, so there's one waiting
+        i2c_bus_request_t batch[I2C_BUS_MAX_BATCH];
+        int results[I2C_BUS_MAX_BATCH];
+        portENTER_CRITICAL(&i2c_bus_lock);
+        size_t count = i2c_bus_sched_next(&i2c_bus_sched, batch);
+        portEXIT_CRITICAL(&i2c_bus_lock);
+        // a request is queued just before its give, so the gives for the
+        // rest of the batch are there or on their way
+        for (size_t i = 1; i < count; ++i) {
+            xSemaphoreTake(i2c_bus_pending, portMAX_DELAY);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (batch[i].write == NULL) {
+                batch[i].write = batch[i].inline_data;
+            }
+        }
+        i2c_bus_sched_execute(batch, count, i2c_bus_execute, NULL, results);
+        const int64_t done_us = esp_timer_get_time();
+        portENTER_CRITICAL(&i2c_bus_lock);
+        for (size_t i = 0; i < count; ++i) {
+            i2c_bus_sched_record(&i2c_bus_sched, &batch[i], results[i],
+                                 done_us);
+        }
+        portEXIT_CRITICAL(&i2c_bus_lock);
+        for (size_t i = 0; i < count; ++i) {
+            if (batch[i].callback != NULL) {
+                batch[i].callback(results[i], batch[i].state);
+            }
+        }
+    }
+}
+static void i2c_bus_initialize(void) {
+    i2c_bus_sched_reset(&i2c_bus_sched, I2C_BUS_BATCH);
+    i2c_bus_pending = xSemaphoreCreateCounting(
+        I2C_BUS_QUEUE_SIZE * I2C_PRIORITY_COUNT, 0);
+    if (i2c_bus_pending == NULL) {
+        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
+    TaskHandle_t handle = NULL;
+    // above the callers so a request is serviced as soon as it's queued
+    xTaskCreate(i2c_bus_task, "i2c_bus", 3072, NULL,
+                uxTaskPriorityGet(NULL) + 2, &handle);
+    if (handle == NULL) {
+        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
+}
+int i2c_bus_submit(uint8_t address, const uint8_t* write, size_t write_len,
+                   uint8_t* read, size_t read_len, i2c_priority_t priority,
+                   uint32_t timeout, i2c_bus_callback_t callback,
+                   void* state) {
+    if (i2c_bus_pending == NULL || priority < 0 ||
+        priority >= I2C_PRIORITY_COUNT) {
+        return 0;
+    }
+    i2c_bus_request_t request;
+    request.address = address;
+    request.write_len = write_len;
+    if (write_len <= I2C_BUS_INLINE) {
+        // small writes travel with the request, so the caller needn't keep them
+        if (write_len > 0) {
+            memcpy(request.inline_data, write, write_len);
+        }
+        request.write = NULL;
+    } else {
+        request.write = write;
+    }
+    request.read = read;
+    request.read_len = read_len;
+    request.timeout = timeout;
+    request.queued_us = esp_timer_get_time();
+    request.callback = callback;
+    request.state = state;
+    TickType_t start = xTaskGetTickCount();
+    while (1) {
+        portENTER_CRITICAL(&i2c_bus_lock);
+        int queued = i2c_bus_sched_push(&i2c_bus_sched, &request, priority);
+        portEXIT_CRITICAL(&i2c_bus_lock);
+        if (queued) {
+            break;
+        }
+        // full. wait for the bus task to make room
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(timeout)) {
+            return 0;
+        }
+        vTaskDelay(1);
+    }
+    xSemaphoreGive(i2c_bus_pending);
+    return 1;
+}
+typedef struct {
+    SemaphoreHandle_t done;
+    esp_err_t result;
+} i2c_bus_waiter_t;
+static void i2c_bus_wake(esp_err_t result, void* state) {
+    i2c_bus_waiter_t* waiter = (i2c_bus_waiter_t*)state;
+    waiter->result = result;
+    xSemaphoreGive(waiter->done);
+}
+esp_err_t i2c_bus_transfer(uint8_t address, const uint8_t* write,
+                           size_t write_len, uint8_t* read, size_t read_len,
+                           i2c_priority_t priority, uint32_t timeout) {
+    StaticSemaphore_t done;
+    i2c_bus_waiter_t waiter;
+    waiter.done = xSemaphoreCreateBinaryStatic(&done);
+    waiter.result = ESP_FAIL;
+    if (!i2c_bus_submit(address, write, write_len, read, read_len, priority,
+                        timeout, i2c_bus_wake, &waiter)) {
+        return ESP_ERR_TIMEOUT;
+    }
+    // the request points at our stack, so it has to finish before we return.
+    // the bus task's own timeout guarantees it will
+    xSemaphoreTake(waiter.done, portMAX_DELAY);
+    return waiter.result;
+}
+void i2c_bus_stats(uint8_t address, i2c_bus_stats_t* out_stats, int reset) {
+    i2c_bus_stats_t stats;
+    portENTER_CRITICAL(&i2c_bus_lock);
+    i2c_bus_sched_stats(&i2c_bus_sched, address, &stats, reset);
+    portEXIT_CRITICAL(&i2c_bus_lock);
+    if (out_stats != NULL) {
+        *out_stats = stats;
+    }
+}
+
 static void i2c_initialize() {
     if (led_initialized || i2c_initialized) {
         return;
     }
+#if CONFIG_SCCB_HARDWARE_I2C_DRIVER_NEW
+    i2c_master_bus_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.i2c_port = I2C_NUM_0;
+    config.sda_io_num = I2C_SDA;
+    config.scl_io_num = I2C_SCL;
+    config.clk_source = I2C_CLK_SRC_DEFAULT;
+    config.glitch_ignore_cnt = 7;
+    config.flags.enable_internal_pullup = 1;
+    ESP_ERROR_CHECK(i2c_new_master_bus(&config, &i2c_bus_handle));
+    memset(i2c_bus_handles, 0, sizeof(i2c_bus_handles));
+#else
     i2c_config_t config;
     memset(&config, 0, sizeof(config));
     config.master.clk_speed = I2C_SPEED;
@@ -553,6 +2394,8 @@ static void i2c_initialize() {
     config.sda_pullup_en = 1;
     ESP_ERROR_CHECK(i2c_param_config(I2C_NUM_0, &config));
     ESP_ERROR_CHECK(i2c_driver_install(I2C_NUM_0, I2C_MODE_MASTER, 0, 0, 0));
+#endif
+    i2c_bus_initialize();
     i2c_initialized = 1;
 }
 // static void i2c_deinitialize() {
@@ -568,86 +2411,25 @@ static int touch_initialized = 0;
 static uint32_t touch_timestamp = 0;
 static size_t touch_count = 0;
 static uint16_t touch_x_data[2], touch_y_data[2], touch_id_data[2];
+// guards the above once the event task is writing them
+static portMUX_TYPE touch_lock = portMUX_INITIALIZER_UNLOCKED;
+static volatile int touch_task_running = 0;
 static int touch_write_reg(int r, int value) {
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    if (ESP_OK != i2c_master_start(cmd)) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    if (ESP_OK != i2c_master_write_byte(cmd, 0x38 << 1 | I2C_MASTER_WRITE,
-                                        I2C_MASTER_ACK)) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    uint8_t data[2];
-    data[0] = r;
-    data[1] = value;
-    if (ESP_OK != i2c_master_write(cmd, data, sizeof(data), I2C_MASTER_ACK)) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    if (ESP_OK != i2c_master_stop(cmd)) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    if (ESP_OK != i2c_master_cmd_begin(I2C_NUM_0, cmd, portMAX_DELAY)) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    i2c_cmd_link_delete(cmd);
-    return 1;
+    uint8_t data[2] = {(uint8_t)r, (uint8_t)value};
+    return ESP_OK == i2c_bus_transfer(0x38, data, sizeof(data), NULL, 0,
+                                      I2C_PRIORITY_HIGH, 1000);
+}
+static int touch_read_regs(uint8_t reg, uint8_t* data, size_t len) {
+    // touch is what the user feels, so it goes ahead of everything else
+    return ESP_OK == i2c_bus_transfer(0x38, &reg, 1, data, len,
+                                      I2C_PRIORITY_HIGH, 1000);
 }
 static int touch_read_all() {
-    static const uint8_t ACK_CHECK_EN = 0x1;
     uint8_t i2cdat[16];
-    // Read data
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    if (ESP_OK != i2c_master_start(cmd)) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    if (ESP_OK != i2c_master_write_byte(cmd, (0x38 << 1), ACK_CHECK_EN)) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    if (ESP_OK != i2c_master_write_byte(cmd, 0, ACK_CHECK_EN)) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    if (ESP_OK != i2c_master_stop(cmd)) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    if (ESP_OK != i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(1000))) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    i2c_cmd_link_delete(cmd);
-
-    cmd = i2c_cmd_link_create();
-    if (ESP_OK != i2c_master_start(cmd)) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    if (ESP_OK != i2c_master_write_byte(cmd, (0x38 << 1) | 1, ACK_CHECK_EN)) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    if (ESP_OK !=
-        i2c_master_read(cmd, i2cdat, sizeof(i2cdat), I2C_MASTER_LAST_NACK)) {
-        i2c_cmd_link_delete(cmd);
+    if (!touch_read_regs(0, i2cdat, sizeof(i2cdat))) {
         return 0;
     }
-    if (ESP_OK != i2c_master_stop(cmd)) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    if (ESP_OK != i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(1000))) {
-        i2c_cmd_link_delete(cmd);
-        return 0;
-    }
-    i2c_cmd_link_delete(cmd);
-
+    portENTER_CRITICAL(&touch_lock);
     touch_count = i2cdat[0x02];
     if (touch_count > 2) {
         touch_count = 0;
@@ -662,6 +2444,7 @@ static int touch_read_all() {
         touch_y_data[i] |= i2cdat[0x06 + i * 6];
         touch_id_data[i] = i2cdat[0x05 + i * 6] >> 4;
     }
+    portEXIT_CRITICAL(&touch_lock);
     return 1;
 }
 void touch_initialize(int threshhold) {
@@ -680,6 +2463,7 @@ void touch_deinitialize() {
     if (!touch_initialized) {
         return;
     }
+    touch_events_deinitialize();
     // nothing for now
     touch_initialized = 0;
 }
@@ -688,6 +2472,10 @@ static int touch_update() {
     if (!touch_initialized) {
         return 0;
     }
+    if (touch_task_running) {
+        // the event task keeps the points current
+        return 1;
+    }
     uint32_t ms = pdTICKS_TO_MS(xTaskGetTickCount());
     if (ms > touch_timestamp + 13) {
         if (!touch_read_all()) {
@@ -718,7 +2506,12 @@ static void touch_translate(uint16_t* x, uint16_t* y) {
     }
 }
 static int touch_read_point(size_t n, uint16_t* out_x, uint16_t* out_y) {
-    if (touch_count == 0 || n >= touch_count) {
+    portENTER_CRITICAL(&touch_lock);
+    size_t count = touch_count;
+    uint16_t x = n < 2 ? touch_x_data[n] : 0;
+    uint16_t y = n < 2 ? touch_y_data[n] : 0;
+    portEXIT_CRITICAL(&touch_lock);
+    if (count == 0 || n >= count) {
         if (out_x != NULL) {
             *out_x = 0;
         }
@@ -727,8 +2520,6 @@ static int touch_read_point(size_t n, uint16_t* out_x, uint16_t* out_y) {
         }
         return 0;
     }
-    uint16_t x = touch_x_data[n];
-    uint16_t y = touch_y_data[n];
     if (x >= 240) {
         x = 240 - 1;
     }
@@ -757,6 +2548,225 @@ int touch_xy2(uint16_t* out_x, uint16_t* out_y) {
     return touch_read_point(1, out_x, out_y);
 }
 
+// The event task reads the controller at its report rate while the panel is
+// touched and turns the changes into down/move/up events. Between touches it
+// either sleeps on the INT line, or without one, polls just the touch count.
+// Events go through a single producer, single consumer ring, so neither side
+// ever blocks the other.
+#define TOUCH_ACTIVE_MS 13
+#define TOUCH_IDLE_MS 50
+static touch_event_t touch_events[TOUCH_EVENT_QUEUE_SIZE];
+static uint32_t touch_event_head = 0;
+static uint32_t touch_event_tail = 0;
+static volatile uint32_t touch_events_lost = 0;
+static touch_gesture_t touch_gesture_queue[TOUCH_EVENT_QUEUE_SIZE];
+static uint32_t touch_gesture_head = 0;
+static uint32_t touch_gesture_tail = 0;
+static touch_gestures_t touch_gestures;
+static uint32_t touch_idle_ms = TOUCH_IDLE_MS;
+static TaskHandle_t touch_task_handle = NULL;
+static SemaphoreHandle_t touch_task_done = NULL;
+
+static void touch_gesture_push(const touch_gesture_t* gestures, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t head = __atomic_load_n(&touch_gesture_head, __ATOMIC_RELAXED);
+        uint32_t tail = __atomic_load_n(&touch_gesture_tail, __ATOMIC_ACQUIRE);
+        if (head - tail >= TOUCH_EVENT_QUEUE_SIZE) {
+            ++touch_events_lost;
+            return;
+        }
+        touch_gesture_queue[head % TOUCH_EVENT_QUEUE_SIZE] = gestures[i];
+        __atomic_store_n(&touch_gesture_head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+int touch_gesture_read(touch_gesture_t* out_gesture) {
+    uint32_t tail = __atomic_load_n(&touch_gesture_tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&touch_gesture_head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return 0;
+    }
+    *out_gesture = touch_gesture_queue[tail % TOUCH_EVENT_QUEUE_SIZE];
+    __atomic_store_n(&touch_gesture_tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+static void touch_event_push(touch_event_type_t type, uint8_t id, uint16_t x,
+                             uint16_t y, int64_t timestamp_us) {
+    if (x >= 240) {
+        x = 240 - 1;
+    }
+    if (y >= 320) {
+        y = 320 - 1;
+    }
+    touch_translate(&x, &y);
+    touch_event_t event;
+    event.timestamp_us = timestamp_us;
+    event.x = x;
+    event.y = y;
+    event.id = id;
+    event.type = type;
+    // the recognizer sees every event, even if the reader misses some
+    touch_gesture_t gestures[2];
+    touch_gesture_push(gestures,
+                       touch_gestures_feed(&touch_gestures, &event, gestures, 2));
+    uint32_t head = __atomic_load_n(&touch_event_head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&touch_event_tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= TOUCH_EVENT_QUEUE_SIZE) {
+        // the reader fell behind. keep what it hasn't seen yet
+        ++touch_events_lost;
+        return;
+    }
+    touch_events[head % TOUCH_EVENT_QUEUE_SIZE] = event;
+    __atomic_store_n(&touch_event_head, head + 1, __ATOMIC_RELEASE);
+}
+int touch_event_read(touch_event_t* out_event) {
+    uint32_t tail = __atomic_load_n(&touch_event_tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&touch_event_head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return 0;
+    }
+    *out_event = touch_events[tail % TOUCH_EVENT_QUEUE_SIZE];
+    __atomic_store_n(&touch_event_tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+uint32_t touch_events_dropped(int reset) {
+    uint32_t result = touch_events_lost;
+    if (reset) {
+        touch_events_lost = 0;
+    }
+    return result;
+}
+// compare the new points against the last ones by id
+static void touch_diff(size_t old_count, const uint16_t* old_x,
+                       const uint16_t* old_y, const uint16_t* old_id,
+                       int64_t timestamp_us) {
+    size_t count = touch_count;
+    for (size_t i = 0; i < old_count; ++i) {
+        size_t j = 0;
+        while (j < count && touch_id_data[j] != old_id[i]) {
+            ++j;
+        }
+        if (j == count) {
+            touch_event_push(TOUCH_EVENT_UP, old_id[i], old_x[i], old_y[i],
+                             timestamp_us);
+        }
+    }
+    for (size_t j = 0; j < count; ++j) {
+        size_t i = 0;
+        while (i < old_count && old_id[i] != touch_id_data[j]) {
+            ++i;
+        }
+        if (i == old_count) {
+            touch_event_push(TOUCH_EVENT_DOWN, touch_id_data[j],
+                             touch_x_data[j], touch_y_data[j], timestamp_us);
+        } else if (old_x[i] != touch_x_data[j] ||
+                   old_y[i] != touch_y_data[j]) {
+            touch_event_push(TOUCH_EVENT_MOVE, touch_id_data[j],
+                             touch_x_data[j], touch_y_data[j], timestamp_us);
+        }
+    }
+}
+#if TOUCH_INT >= 0
+IRAM_ATTR static void touch_isr(void* arg) {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(touch_task_handle, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+#endif
+static void touch_task(void* arg) {
+    while (touch_task_running) {
+        if (touch_count == 0) {
+#if TOUCH_INT >= 0
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#else
+            vTaskDelay(pdMS_TO_TICKS(touch_idle_ms));
+            uint8_t status;
+            if (!touch_read_regs(0x02, &status, 1) || status == 0 ||
+                status > 2) {
+                continue;
+            }
+#endif
+            if (!touch_task_running) {
+                break;
+            }
+        }
+        // only this task writes the points, so it can read them unlocked
+        size_t old_count = touch_count;
+        uint16_t old_x[2], old_y[2], old_id[2];
+        memcpy(old_x, touch_x_data, sizeof(old_x));
+        memcpy(old_y, touch_y_data, sizeof(old_y));
+        memcpy(old_id, touch_id_data, sizeof(old_id));
+        int64_t timestamp = esp_timer_get_time();
+        if (touch_read_all()) {
+            touch_diff(old_count, old_x, old_y, old_id, timestamp);
+            // a finger held still makes no events, but may be a long press
+            touch_gesture_t gestures[2];
+            touch_gesture_push(gestures,
+                               touch_gestures_tick(&touch_gestures, timestamp,
+                                                   gestures, 2));
+        }
+        if (touch_count != 0) {
+            vTaskDelay(pdMS_TO_TICKS(TOUCH_ACTIVE_MS));
+        }
+    }
+    xSemaphoreGive(touch_task_done);
+    vTaskDelete(NULL);
+}
+int touch_events_initialize(uint32_t idle_poll_ms) {
+    if (!touch_initialized || touch_task_running) {
+        return 0;
+    }
+    touch_idle_ms = idle_poll_ms ? idle_poll_ms : TOUCH_IDLE_MS;
+    touch_event_head = 0;
+    touch_event_tail = 0;
+    touch_gesture_head = 0;
+    touch_gesture_tail = 0;
+    touch_gestures_reset(&touch_gestures);
+    touch_events_lost = 0;
+    touch_task_done = xSemaphoreCreateBinary();
+    if (touch_task_done == NULL) {
+        return 0;
+    }
+    touch_task_running = 1;
+    xTaskCreate(touch_task, "touch", 3072, NULL, uxTaskPriorityGet(NULL) + 1,
+                &touch_task_handle);
+    if (touch_task_handle == NULL) {
+        touch_task_running = 0;
+        vSemaphoreDelete(touch_task_done);
+        touch_task_done = NULL;
+        return 0;
+    }
+#if TOUCH_INT >= 0
+    gpio_config_t io_conf;
+    memset(&io_conf, 0, sizeof(io_conf));
+    io_conf.intr_type = GPIO_INTR_NEGEDGE;
+    io_conf.mode = GPIO_MODE_INPUT;
+    io_conf.pin_bit_mask = 1ULL << TOUCH_INT;
+    io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
+    ESP_ERROR_CHECK(gpio_config(&io_conf));
+    // someone else may have installed it already
+    gpio_install_isr_service(0);
+    ESP_ERROR_CHECK(
+        gpio_isr_handler_add((gpio_num_t)TOUCH_INT, touch_isr, NULL));
+    // pick up a touch that started before we were listening
+    xTaskNotifyGive(touch_task_handle);
+#endif
+    return 1;
+}
+void touch_events_deinitialize(void) {
+    if (!touch_task_running) {
+        return;
+    }
+#if TOUCH_INT >= 0
+    gpio_isr_handler_remove((gpio_num_t)TOUCH_INT);
+#endif
+    touch_task_running = 0;
+    xTaskNotifyGive(touch_task_handle);
+    xSemaphoreTake(touch_task_done, portMAX_DELAY);
+    vSemaphoreDelete(touch_task_done);
+    touch_task_done = NULL;
+    touch_task_handle = NULL;
+}
+
 static uint16_t* audio_out_buffer = NULL;
 static i2s_chan_handle_t audio_handle = NULL;
 
@@ -875,83 +2885,78 @@ size_t audio_write_float(const float* samples, size_t sample_count, float vel) {
     return result;
 }
 static int prox_sensor_initialized = 0;
-typedef struct {
-    uint32_t red[4];
-    uint32_t IR[4];
-    uint32_t green[4];
-    uint8_t head;
-    uint8_t tail;
-} prox_sensor_info_t;  // This is our circular buffer of readings from the
-                       // sensor
-
-static prox_sensor_info_t prox_sensor_data;
+// Samples land in a ring, oldest first. It starts small and static, and
+// prox_sensor_buffer() can swap in a bigger one
+#define PROX_SENSOR_DEFAULT_CAPACITY 32
+static prox_sample_t prox_sensor_default_ring[PROX_SENSOR_DEFAULT_CAPACITY];
+static prox_sample_t* prox_sensor_ring = prox_sensor_default_ring;
+static size_t prox_sensor_capacity = PROX_SENSOR_DEFAULT_CAPACITY;
+static size_t prox_sensor_ring_head = 0;
+static size_t prox_sensor_ring_count = 0;
+static volatile uint32_t prox_sensor_total = 0;
+static volatile uint32_t prox_sensor_lost = 0;
+static portMUX_TYPE prox_sensor_lock = portMUX_INITIALIZER_UNLOCKED;
+// fed from every sample that comes out of the FIFO. the estimator runs on a
+// copy outside the lock, and changes counts the writes it would clobber
+static prox_presence_t prox_sensor_presence_state;
+static uint32_t prox_sensor_presence_changes = 0;
+static uint32_t prox_sensor_period_us = 0;
+static volatile int prox_sensor_task_running = 0;
 static uint8_t prox_sensor_active_leds;
+// held around the register shadow and its commits, and for the whole of a
+// FIFO drain, so configuration calls can't land while the drain task is
+// mid-decode or switching power. it's created once and never deleted
+static SemaphoreHandle_t prox_sensor_mutex = NULL;
+static StaticSemaphore_t prox_sensor_mutex_buffer;
 //
-static esp_err_t prox_sensor_read(uint8_t* data_rd, size_t size) {
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (0x57 << 1) | I2C_MASTER_READ, I2C_MASTER_NACK);
-    i2c_master_read(cmd, data_rd, size, I2C_MASTER_LAST_NACK);
-    i2c_master_stop(cmd);
-    esp_err_t ret = i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(1000));
-    i2c_cmd_link_delete(cmd);
-    return ret;
-}
-
-static esp_err_t prox_sensor_write(uint8_t* data_wr, size_t size) {
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (0x57 << 1) | I2C_MASTER_WRITE, I2C_MASTER_NACK);
-    while(size--) {
-        i2c_master_write_byte(cmd,*(data_wr++), I2C_MASTER_ACK);
-    }
-    i2c_master_stop(cmd);
-    esp_err_t ret = i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(1000));
-    i2c_cmd_link_delete(cmd);
-    return ret;
+static esp_err_t prox_sensor_write(const uint8_t* data_wr, size_t size) {
+    return i2c_bus_transfer(0x57, data_wr, size, NULL, 0, I2C_PRIORITY_NORMAL,
+                            1000);
 }
-static void prox_sensor_read_reg(uint8_t reg_addr, uint8_t* data_reg,
-                                 size_t bytes_to_read) {
-    ESP_ERROR_CHECK(prox_sensor_write(&reg_addr, 1));
-    ESP_ERROR_CHECK(prox_sensor_read(data_reg, bytes_to_read));
+static esp_err_t prox_sensor_read_reg(uint8_t reg_addr, uint8_t* data_reg,
+                                      size_t bytes_to_read) {
+    return i2c_bus_transfer(0x57, &reg_addr, 1, data_reg, bytes_to_read,
+                            I2C_PRIORITY_NORMAL, 1000);
 }
 
 static void prox_sensor_write_reg(uint8_t command, uint8_t reg) {
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (0x57 << 1) | I2C_MASTER_WRITE, I2C_MASTER_NACK);
-    i2c_master_write_byte(cmd, command, I2C_MASTER_ACK);
-    i2c_master_write_byte(cmd, reg, I2C_MASTER_ACK);
-    i2c_master_stop(cmd);
-    esp_err_t ret = i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(1000));
-    i2c_cmd_link_delete(cmd);
-    ESP_ERROR_CHECK(ret);
-}
-// Given a register, read it, mask it, and then set the thing
+    uint8_t data[2] = {command, reg};
+    ESP_ERROR_CHECK(prox_sensor_write(data, sizeof(data)));
+}
+// The configuration registers are shadowed (see prox_shadow_commit()), and
+// only change on the part when they're committed
+static prox_shadow_t prox_sensor_shadow;
+static int prox_sensor_shadow_write(const uint8_t* data, size_t len,
+                                    void* state) {
+    return prox_sensor_write(data, len);
+}
+static void prox_sensor_shadow_load(void) {
+    prox_shadow_reset(&prox_sensor_shadow);
+    // FIFO config through the multi-LED slots, and the prox threshold
+    ESP_ERROR_CHECK(prox_sensor_read_reg(0x08, prox_sensor_shadow.regs + 0x08,
+                                         0x12 - 0x08 + 1));
+    prox_shadow_loaded(&prox_sensor_shadow, 0x08, 0x12 - 0x08 + 1);
+    ESP_ERROR_CHECK(
+        prox_sensor_read_reg(0x30, prox_sensor_shadow.regs + 0x30, 1));
+    prox_shadow_loaded(&prox_sensor_shadow, 0x30, 1);
+}
+static void prox_sensor_set_reg(uint8_t reg, uint8_t value) {
+    prox_shadow_set(&prox_sensor_shadow, reg, value);
+}
+// Given a register, mask it, and then set the thing
 static void prox_sensor_mask_reg(uint8_t reg, uint8_t mask, uint8_t thing) {
-    // Grab current register context
-    uint8_t originalContents;
-    prox_sensor_read_reg(reg, &originalContents, 1);
-    // Zero-out the portions of the register we're interested in
-    originalContents = originalContents & mask;
-
-    // Change contents
-    prox_sensor_write_reg(reg, originalContents | thing);
+    if (!prox_shadow_mask(&prox_sensor_shadow, reg, mask, thing)) {
+        ESP_ERROR_CHECK(
+            prox_sensor_read_reg(reg, &prox_sensor_shadow.regs[reg], 1));
+        prox_shadow_loaded(&prox_sensor_shadow, reg, 1);
+        prox_shadow_mask(&prox_sensor_shadow, reg, mask, thing);
+    }
 }
-
-// Read the FIFO Write Pointer
-static uint8_t prox_sensor_write_pointer(void) {
-    uint8_t result;
-    prox_sensor_read_reg(0x04, &result, 1);
-    return result;
+static esp_err_t prox_sensor_commit(void) {
+    return prox_shadow_commit(&prox_sensor_shadow, prox_sensor_shadow_write,
+                              NULL);
 }
 
-// Read the FIFO Read Pointer
-static uint8_t prox_sensor_read_pointer(void) {
-    uint8_t result;
-    prox_sensor_read_reg(0x06, &result, 1);
-    return result;
-}
 // static void prox_sensor_soft_reset(void) {
 //     prox_sensor_mask_reg(0x09, 0xBF, 0x40);
 //     // Poll for bit to clear, reset is then complete
@@ -990,19 +2995,19 @@ static void prox_sensor_pulse_width(uint8_t pulseWidth) {
 // NOTE: Amplitude values: 0x00 = 0mA, 0x7F = 25.4mA, 0xFF = 50mA (typical)
 // See datasheet, page 21
 static void prox_sensor_pulse_amp_red(uint8_t amplitude) {
-    prox_sensor_write_reg(0x0C, amplitude);
+    prox_sensor_set_reg(0x0C, amplitude);
 }
 
 static void prox_sensor_pulse_amp_ir(uint8_t amplitude) {
-    prox_sensor_write_reg(0x0D, amplitude);
+    prox_sensor_set_reg(0x0D, amplitude);
 }
 
 static void prox_sensor_pulse_amp_green(uint8_t amplitude) {
-    prox_sensor_write_reg(0x0C, amplitude);
+    prox_sensor_set_reg(0x0E, amplitude);
 }
 
 static void prox_sensor_pulse_amp_prox(uint8_t amplitude) {
-    prox_sensor_write_reg(0x10, amplitude);
+    prox_sensor_set_reg(0x10, amplitude);
 }
 
 // Set sample average (Table 3, Page 18)
@@ -1060,132 +3065,228 @@ static void prox_sensor_enable_slot(uint8_t slotNumber, uint8_t device) {
 }
 // Polls the sensor for new data
 // Call regularly
-// If new data is available, it updates the head and tail in the main struct
+static void prox_sensor_push(const prox_sample_t* samples, int count) {
+    portENTER_CRITICAL(&prox_sensor_lock);
+    for (int i = 0; i < count; ++i) {
+        prox_sensor_ring[prox_sensor_ring_head] = samples[i];
+        prox_sensor_ring_head = (prox_sensor_ring_head + 1) % prox_sensor_capacity;
+        if (prox_sensor_ring_count == prox_sensor_capacity) {
+            // nobody's reading. the oldest goes
+            ++prox_sensor_lost;
+        } else {
+            ++prox_sensor_ring_count;
+        }
+    }
+    prox_sensor_total += count;
+    prox_presence_t presence = prox_sensor_presence_state;
+    const uint32_t changes = prox_sensor_presence_changes;
+    portEXIT_CRITICAL(&prox_sensor_lock);
+    prox_presence_update(&presence, samples, count);
+    portENTER_CRITICAL(&prox_sensor_lock);
+    // if it was tuned, calibrated or reset in the meantime, that wins
+    if (changes == prox_sensor_presence_changes) {
+        prox_sensor_presence_state = presence;
+    }
+    portEXIT_CRITICAL(&prox_sensor_lock);
+}
+static void prox_sensor_period(uint8_t sample_rate, uint8_t sample_average) {
+    static const uint16_t rates[] = {50, 100, 200, 400, 800, 1000, 1600, 3200};
+    // the FIFO gets one averaged sample per so many readings
+    prox_sensor_period_us = (1000000 << (sample_average >> 5)) /
+                            rates[(sample_rate >> 2) & 7];
+}
+
+// The power controller drops the sample rate and LED current while the scene
+// holds still, and puts them back as soon as it changes. Samples are scaled
+// back up to full power before they're stored, so readers and presence see
+// the same levels either side of the switch. Fewer samples also means the
+// drain task wakes less often, so the bus goes quiet too. All of it runs with
+// prox_sensor_mutex held.
+#define PROX_SENSOR_IDLE_RATE PROX_SENS_SAMPLERATE_50
+// a quarter of the current
+#define PROX_SENSOR_IDLE_SHIFT 2
+static uint32_t prox_sensor_idle_ms = 0;
+static int prox_sensor_idle = 0;
+static uint8_t prox_sensor_active_rate = 0;
+static uint8_t prox_sensor_average = 0;
+static int64_t prox_sensor_activity_us = 0;
+static float prox_sensor_activity_level = 0;
+// red, IR, green and pilot LED current, and the prox threshold, as they were
+// when it went idle. whatever configure or pulse_amp_threshold set is what
+// it comes back to
+static const uint8_t prox_sensor_power_regs[5] = {0x0C, 0x0D, 0x0E, 0x10,
+                                                  0x30};
+static uint8_t prox_sensor_active_regs[5];
+// full power over current LED power for red, IR and green
+static float prox_sensor_gain[3] = {1.0f, 1.0f, 1.0f};
+static uint8_t prox_sensor_idle_amp(uint8_t amp) {
+    uint8_t result = amp >> PROX_SENSOR_IDLE_SHIFT;
+    if (result < 2) {
+        result = amp < 2 ? amp : 2;
+    }
+    return result;
+}
+static void prox_sensor_power(int idle) {
+    uint8_t rate = prox_sensor_active_rate;
+    if (idle && rate > PROX_SENSOR_IDLE_RATE) {
+        rate = PROX_SENSOR_IDLE_RATE;
+    }
+    prox_sensor_mask_reg(0x0A, 0xE3, rate);
+    for (int i = 0; i < 3; ++i) {
+        const uint8_t active = prox_sensor_active_regs[i];
+        const uint8_t amp = idle ? prox_sensor_idle_amp(active) : active;
+        prox_sensor_set_reg(prox_sensor_power_regs[i], amp);
+        prox_sensor_gain[i] = amp ? (float)active / amp : 1.0f;
+    }
+    if (!idle) {
+        prox_sensor_set_reg(0x10, prox_sensor_active_regs[3]);
+        prox_sensor_set_reg(0x30, prox_sensor_active_regs[4]);
+    }
+#if PROX_INT >= 0
+    // past the 0x30 trip point the part leaves its pilot LED proximity mode
+    // on its own, and the interrupt wakes the drain task
+    if (prox_sensor_task_running) {
+        prox_sensor_set_reg(0x02, idle ? 0x90 : 0x80);
+    }
+    if (idle) {
+        prox_sensor_set_reg(0x10,
+                            prox_sensor_idle_amp(prox_sensor_active_regs[3]));
+        // writing the mode, even unchanged, restarts proximity mode
+        prox_sensor_shadow.dirty |= 1ULL << 0x09;
+    }
+#endif
+    // this runs on the drain path too. a failed write stays dirty and the
+    // next poll tries it again
+    if (prox_sensor_commit() != ESP_OK) {
+        ++prox_sensor_lost;
+    }
+    prox_sensor_period(rate, prox_sensor_average);
+    prox_sensor_idle = idle;
+}
+static void prox_sensor_adapt(void) {
+    if (prox_sensor_idle_ms == 0) {
+        return;
+    }
+    portENTER_CRITICAL(&prox_sensor_lock);
+    const int present = prox_sensor_presence_state.present;
+    const float filtered = prox_sensor_presence_state.filtered;
+    const float exit = prox_sensor_presence_state.exit;
+    const float enter_level = prox_sensor_presence_state.baseline +
+                              prox_sensor_presence_state.enter;
+    portEXIT_CRITICAL(&prox_sensor_lock);
+    int64_t now = esp_timer_get_time();
+    if (present || fabsf(filtered - prox_sensor_activity_level) > exit) {
+        prox_sensor_activity_level = filtered;
+        prox_sensor_activity_us = now;
+        if (prox_sensor_idle) {
+            prox_sensor_power(0);
+        }
+    } else if (!prox_sensor_idle &&
+               now - prox_sensor_activity_us >
+                   (int64_t)prox_sensor_idle_ms * 1000) {
+        for (int i = 0; i < 5; ++i) {
+            prox_sensor_active_regs[i] =
+                prox_sensor_shadow.regs[prox_sensor_power_regs[i]];
+        }
+        // the presence threshold as the pilot LED sees it at idle power, in
+        // the 8 MSBs of the 18 bit count that the part compares against
+        const uint8_t ir = prox_sensor_active_regs[1];
+        float trip = enter_level;
+        if (ir != 0) {
+            trip = trip * prox_sensor_idle_amp(prox_sensor_active_regs[3]) / ir;
+        }
+        uint32_t thresh = ((uint32_t)trip) >> 10;
+        prox_sensor_set_reg(0x30, thresh > 0xFF ? 0xFF : (uint8_t)thresh);
+        prox_sensor_power(1);
+    }
+}
+int prox_sensor_adaptive(uint32_t idle_ms) {
+    if (!prox_sensor_initialized) {
+        return 0;
+    }
+    xSemaphoreTake(prox_sensor_mutex, portMAX_DELAY);
+    if (prox_sensor_active_leds == 0) {
+        // not configured yet
+        xSemaphoreGive(prox_sensor_mutex);
+        return 0;
+    }
+    prox_sensor_idle_ms = idle_ms;
+    prox_sensor_activity_us = esp_timer_get_time();
+    if (idle_ms == 0 && prox_sensor_idle) {
+        prox_sensor_power(0);
+    }
+    xSemaphoreGive(prox_sensor_mutex);
+    return 1;
+}
+
+// If new data is available, it moves it from the FIFO into the ring
 // Returns number of new samples obtained
 static uint16_t prox_sensor_update_impl(void) {
-    // Read register FIDO_DATA in (3-uint8_t * number of active LED) chunks
-    // Until FIFO_RD_PTR = FIFO_WR_PTR
-    uint8_t readPointer = prox_sensor_read_pointer();
-    uint8_t writePointer = prox_sensor_write_pointer();
-    //printf("read: %d, write: %d\n",readPointer,writePointer);
-    int numberOfSamples = 0;
-
-    // Do we have new data?
-    if (readPointer != writePointer) {
-        //puts("new data");
-        // Calculate the number of readings we need to get from sensor
-        numberOfSamples = writePointer - readPointer;
-        if (numberOfSamples < 0) numberOfSamples += 32;  // Wrap condition
-
-        // We now have the number of readings, now calc bytes to read
-        // For this example we are just doing Red and IR (3 bytes each)
-
-        int bytesLeftToRead = numberOfSamples * prox_sensor_active_leds * 3;
-
-        // Get ready to read a burst of data from the FIFO register
-        uint8_t tmp = 0x07;
-        //prox_sensor_write(&tmp, 1);
-        i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-        i2c_master_start(cmd);
-        i2c_master_write_byte(cmd, (0x57 << 1) | I2C_MASTER_WRITE, I2C_MASTER_NACK);
-        i2c_master_write_byte(cmd, tmp, I2C_MASTER_ACK);
-        i2c_master_stop(cmd);
-        ESP_ERROR_CHECK(i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(1000)));
-        i2c_cmd_link_delete(cmd);
-
-        static uint8_t block[64];
-        // We may need to read as many as 288 bytes so we read in blocks no
-        // larger than I2C_BUFFER_LENGTH I2C_BUFFER_LENGTH changes based on the
-        // platform. 64 bytes for SAMD21, 32 bytes for Uno. Wire.requestFrom()
-        // is limited to BUFFER_LENGTH which is 32 on the Uno
-        //printf("bytes to fetch: %d\n",bytesLeftToRead);
-        while (bytesLeftToRead > 0) {
-            int toGet = bytesLeftToRead;
-            if (toGet > 64) {
-                // If toGet is 32 this is bad because we read 6 bytes (Red+IR *
-                // 3 = 6) at a time 32 % 6 = 2 left over. We don't want to
-                // request 32 bytes, we want to request 30. 32 % 9
-                // (Red+IR+GREEN) = 5 left over. We want to request 27.
-
-                toGet = 64 - (64 % (prox_sensor_active_leds *
-                                    3));  // Trim toGet to be a multiple of
-                                          // the samples we need to read
-            }
-
-            bytesLeftToRead -= toGet;
-
-            // Request toGet number of bytes from sensor
-            prox_sensor_read(block, toGet);
-            while (toGet > 0) {
-                prox_sensor_data
-                    .head++;  // Advance the head of the storage struct
-                prox_sensor_data.head %= 4;  // Wrap condition
-
-                uint8_t temp[sizeof(uint32_t)];  // Array of 4 bytes that we
-                                                 // will convert into long
-                uint32_t tempLong;
-                uint8_t burst[3];
-                // Burst read three bytes - RED
-                prox_sensor_read(burst, 3);
-                temp[3] = 0;
-                temp[2] = burst[0];
-                temp[1] = burst[1];
-                temp[0] = burst[2];
-                // Convert array to long
-                memcpy(&tempLong, temp, sizeof(tempLong));
-
-                tempLong &= 0x3FFFF;  // Zero out all but 18 bits
-
-                prox_sensor_data.red[prox_sensor_data.head] =
-                    tempLong;  // Store this reading into the sense array
-
-                if (prox_sensor_active_leds>1) {
-                    // Burst read three more bytes - IR
-                    prox_sensor_read(burst, 3);
-                    temp[3] = 0;
-                    temp[2] = burst[0];
-                    temp[1] = burst[1];
-                    temp[0] = burst[2];
-                    // Convert array to long
-                    memcpy(&tempLong, temp, sizeof(tempLong));
-
-                    tempLong &= 0x3FFFF;  // Zero out all but 18 bits
-
-                    prox_sensor_data.IR[prox_sensor_data.head] = tempLong;
-                }
-
-                if (prox_sensor_active_leds>2) {
-                    // Burst read three more bytes - Green
-                    prox_sensor_read(burst, 3);
-                    temp[3] = 0;
-                    temp[2] = burst[0];
-                    temp[1] = burst[1];
-                    temp[0] = burst[2];
-                    // Convert array to long
-                    memcpy(&tempLong, temp, sizeof(tempLong));
-
-                    tempLong &= 0x3FFFF;  // Zero out all but 18 bits
-
-                    prox_sensor_data.green[prox_sensor_data.head] = tempLong;
-                }
-
-                toGet -= prox_sensor_active_leds * 3;
-            }
-
-        }  // End while (bytesLeftToRead > 0)
-
-    }  // End readPtr != writePtr
-    return (numberOfSamples);
+    xSemaphoreTake(prox_sensor_mutex, portMAX_DELAY);
+    if (prox_sensor_active_leds == 0) {
+        // not configured yet
+        xSemaphoreGive(prox_sensor_mutex);
+        return 0;
+    }
+    // the bus is shared, so a NACK or a timeout just costs this poll
+    if (prox_sensor_shadow.dirty != 0 && prox_sensor_commit() != ESP_OK) {
+        ++prox_sensor_lost;
+    }
+    // FIFO_WR_PTR, OVF_COUNTER and FIFO_RD_PTR sit side by side
+    uint8_t pointers[3];
+    if (prox_sensor_read_reg(0x04, pointers, sizeof(pointers)) != ESP_OK) {
+        ++prox_sensor_lost;
+        xSemaphoreGive(prox_sensor_mutex);
+        return 0;
+    }
+    int64_t now = esp_timer_get_time();
+    int samples =
+        prox_sensor_fifo_pending(pointers[0], pointers[1], pointers[2]);
+    if (samples == 0) {
+        xSemaphoreGive(prox_sensor_mutex);
+        return 0;
+    }
+    // reads of FIFO_DATA pop samples without moving the register pointer, so
+    // the whole FIFO comes out in one burst
+    static uint8_t burst[32 * 3 * 3];
+    static prox_sample_t decoded[32];
+    if (prox_sensor_read_reg(0x07, burst,
+                             samples * prox_sensor_active_leds * 3) != ESP_OK) {
+        // whatever is still in the FIFO comes out next poll
+        ++prox_sensor_lost;
+        xSemaphoreGive(prox_sensor_mutex);
+        return 0;
+    }
+    prox_sensor_decode(burst, samples, prox_sensor_active_leds, decoded);
+    // the newest was taken about now, and the rest one period apart before it
+    for (int i = 0; i < samples; ++i) {
+        decoded[i].timestamp_us =
+            now - (int64_t)(samples - 1 - i) * prox_sensor_period_us;
+        if (prox_sensor_idle) {
+            decoded[i].red = (uint32_t)(decoded[i].red * prox_sensor_gain[0]);
+            decoded[i].ir = (uint32_t)(decoded[i].ir * prox_sensor_gain[1]);
+            decoded[i].green =
+                (uint32_t)(decoded[i].green * prox_sensor_gain[2]);
+        }
+    }
+    prox_sensor_push(decoded, samples);
+    prox_sensor_adapt();
+    xSemaphoreGive(prox_sensor_mutex);
+    return (uint16_t)samples;
 }
 static int prox_sensor_update_timeout(uint32_t maxTimeToCheck) {
     uint32_t markTime = pdTICKS_TO_MS(xTaskGetTickCount());
+    uint32_t total = prox_sensor_total;
 
     while (1) {
         if (maxTimeToCheck > 0 &&
             (pdTICKS_TO_MS(xTaskGetTickCount()) - markTime > maxTimeToCheck))
             return (0);
 
-        if (prox_sensor_update_impl() == 1)  // We found new data!
+        if (prox_sensor_task_running) {
+            // the task does the reading
+            if (prox_sensor_total != total) return (1);
+        } else if (prox_sensor_update_impl() > 0)  // We found new data!
             return (1);
 
         vTaskDelay(1);
@@ -1195,6 +3296,14 @@ static int prox_sensor_update_timeout(uint32_t maxTimeToCheck) {
 void prox_sensor_configure(prox_sens_amp_t powerLevel, prox_sens_sampleavg_t sampleAverage, prox_sens_mode_t mode ,
            prox_sens_samplerate_t sampleRate, prox_sens_pulsewidth_t pulseWidth , prox_sens_adcrange_t adcRange) {
     
+    if (!prox_sensor_initialized) {
+        return;
+    }
+    xSemaphoreTake(prox_sensor_mutex, portMAX_DELAY);
+    if (prox_sensor_idle) {
+        // back to the user's currents and threshold first
+        prox_sensor_power(0);
+    }
     //prox_sensor_soft_reset();
     prox_sensor_active_leds = 0;
     // FIFO Configuration
@@ -1218,6 +3327,7 @@ void prox_sensor_configure(prox_sens_amp_t powerLevel, prox_sens_sampleavg_t sam
     prox_sensor_adc_range((uint8_t)adcRange);  // 7.81pA per LSB
 
     prox_sensor_sample_rate((uint8_t)sampleRate);  // Take 50 samples per second
+    prox_sensor_period((uint8_t)sampleRate, (uint8_t)sampleAverage);
 
     // The longer the pulse width the longer range of detection you'll have
     // At 69us and 0.4mA it's about 2 inches
@@ -1256,8 +3366,21 @@ void prox_sensor_configure(prox_sens_amp_t powerLevel, prox_sens_sampleavg_t sam
     // prox_sensor_enable_slot(3, SLOT_GREEN_PILOT);
     //-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
+    ESP_ERROR_CHECK(prox_sensor_commit());
+    // what the power controller comes back to
+    prox_sensor_active_rate = (uint8_t)sampleRate;
+    prox_sensor_average = (uint8_t)sampleAverage;
+    prox_sensor_activity_us = esp_timer_get_time();
+    // a new LED power or range means a new baseline
+    portENTER_CRITICAL(&prox_sensor_lock);
+    prox_presence_t* presence = &prox_sensor_presence_state;
+    prox_presence_initialize(presence, presence->enter, presence->exit,
+                             presence->full_scale);
+    ++prox_sensor_presence_changes;
+    portEXIT_CRITICAL(&prox_sensor_lock);
     prox_sensor_clear_fifo();  // Reset the FIFO before we begin checking the
                                // sensor
+    xSemaphoreGive(prox_sensor_mutex);
 }
 
 int prox_sensor_read_raw(uint32_t* out_red, uint32_t* out_ir,
@@ -1266,21 +3389,207 @@ int prox_sensor_read_raw(uint32_t* out_red, uint32_t* out_ir,
         return 0;
     }
     if (!prox_sensor_update_timeout(timeout)) return 0;
+    portENTER_CRITICAL(&prox_sensor_lock);
+    prox_sample_t latest = prox_sensor_ring[(prox_sensor_ring_head +
+                                             prox_sensor_capacity - 1) %
+                                            prox_sensor_capacity];
+    portEXIT_CRITICAL(&prox_sensor_lock);
     if (out_red) {
-        *out_red = prox_sensor_data.red[prox_sensor_data.head];
+        *out_red = latest.red;
     }
     if (out_ir) {
-        *out_ir = prox_sensor_data.IR[prox_sensor_data.head];
+        *out_ir = latest.ir;
     }
     if (out_green) {
-        *out_green = prox_sensor_data.green[prox_sensor_data.head];
+        *out_green = latest.green;
+    }
+    return 1;
+}
+size_t prox_sensor_read_many(prox_sample_t* out_samples, size_t max_samples,
+                             uint32_t timeout) {
+    if (!prox_sensor_initialized || max_samples == 0) {
+        return 0;
+    }
+    // unlike prox_sensor_update_timeout(), 0 here means don't wait
+    if (prox_sensor_ring_count == 0 && timeout > 0) {
+        prox_sensor_update_timeout(timeout);
+    } else if (!prox_sensor_task_running) {
+        // top up from the FIFO while we're here
+        prox_sensor_update_impl();
+    }
+    portENTER_CRITICAL(&prox_sensor_lock);
+    size_t count = prox_sensor_ring_count < max_samples ? prox_sensor_ring_count
+                                                        : max_samples;
+    size_t tail = (prox_sensor_ring_head + prox_sensor_capacity -
+                   prox_sensor_ring_count) %
+                  prox_sensor_capacity;
+    for (size_t i = 0; i < count; ++i) {
+        out_samples[i] = prox_sensor_ring[tail];
+        tail = (tail + 1) % prox_sensor_capacity;
+    }
+    prox_sensor_ring_count -= count;
+    portEXIT_CRITICAL(&prox_sensor_lock);
+    return count;
+}
+int prox_sensor_presence(float* out_level, float* out_distance_mm) {
+    portENTER_CRITICAL(&prox_sensor_lock);
+    const prox_presence_t presence = prox_sensor_presence_state;
+    portEXIT_CRITICAL(&prox_sensor_lock);
+    if (out_level != NULL) {
+        *out_level = prox_presence_level(&presence);
+    }
+    if (out_distance_mm != NULL) {
+        *out_distance_mm = prox_presence_distance(&presence);
+    }
+    return presence.present;
+}
+int prox_sensor_presence_calibrate(float distance_mm) {
+    portENTER_CRITICAL(&prox_sensor_lock);
+    int result =
+        prox_presence_calibrate(&prox_sensor_presence_state, distance_mm);
+    ++prox_sensor_presence_changes;
+    portEXIT_CRITICAL(&prox_sensor_lock);
+    return result;
+}
+void prox_sensor_presence_tune(float enter, float exit, float full_scale) {
+    portENTER_CRITICAL(&prox_sensor_lock);
+    prox_sensor_presence_state.enter = enter;
+    prox_sensor_presence_state.exit = exit;
+    prox_sensor_presence_state.full_scale = full_scale;
+    ++prox_sensor_presence_changes;
+    portEXIT_CRITICAL(&prox_sensor_lock);
+}
+uint32_t prox_sensor_dropped(int reset) {
+    uint32_t result = prox_sensor_lost;
+    if (reset) {
+        prox_sensor_lost = 0;
+    }
+    return result;
+}
+int prox_sensor_buffer(size_t capacity) {
+    prox_sample_t* ring = prox_sensor_default_ring;
+    if (capacity > PROX_SENSOR_DEFAULT_CAPACITY) {
+        ring = (prox_sample_t*)malloc(capacity * sizeof(prox_sample_t));
+        if (ring == NULL) {
+            return 0;
+        }
+    } else {
+        capacity = PROX_SENSOR_DEFAULT_CAPACITY;
+    }
+    portENTER_CRITICAL(&prox_sensor_lock);
+    prox_sample_t* old = prox_sensor_ring;
+    prox_sensor_ring = ring;
+    prox_sensor_capacity = capacity;
+    prox_sensor_ring_head = 0;
+    prox_sensor_ring_count = 0;
+    portEXIT_CRITICAL(&prox_sensor_lock);
+    if (old != prox_sensor_default_ring) {
+        free(old);
+    }
+    return 1;
+}
+
+// The drain task empties the FIFO into the ring before it can overflow. With
+// the INT line it sleeps until the FIFO is almost full, and without it, for
+// about half the time the FIFO takes to fill.
+static TaskHandle_t prox_sensor_task_handle = NULL;
+static SemaphoreHandle_t prox_sensor_task_done = NULL;
+#if PROX_INT >= 0
+IRAM_ATTR static void prox_sensor_isr(void* arg) {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(prox_sensor_task_handle, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+#endif
+static void prox_sensor_task(void* arg) {
+    while (prox_sensor_task_running) {
+#if PROX_INT >= 0
+        // reading the status clears the interrupt
+        uint8_t status;
+        if (prox_sensor_read_reg(0x00, &status, 1) != ESP_OK) {
+            ++prox_sensor_lost;
+        }
+        prox_sensor_update_impl();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+#else
+        prox_sensor_update_impl();
+        uint32_t ms = (prox_sensor_period_us * 16) / 1000;
+        // at idle rates half a FIFO is a long time to notice someone
+        if (ms > 100) {
+            ms = 100;
+        }
+        vTaskDelay(pdMS_TO_TICKS(ms > 0 ? ms : 1));
+#endif
+    }
+    xSemaphoreGive(prox_sensor_task_done);
+    vTaskDelete(NULL);
+}
+int prox_sensor_task_initialize(int core) {
+    if (!prox_sensor_initialized || prox_sensor_task_running) {
+        return 0;
+    }
+    prox_sensor_task_done = xSemaphoreCreateBinary();
+    if (prox_sensor_task_done == NULL) {
+        return 0;
     }
+#if PROX_INT >= 0
+    // interrupt when 17 samples are in the FIFO, leaving the task 15 to drain it
+    xSemaphoreTake(prox_sensor_mutex, portMAX_DELAY);
+    prox_sensor_mask_reg(0x08, 0xF0, 0x0F);
+    prox_sensor_set_reg(0x02, prox_sensor_idle ? 0x90 : 0x80);
+    ESP_ERROR_CHECK(prox_sensor_commit());
+    xSemaphoreGive(prox_sensor_mutex);
+#endif
+    prox_sensor_task_running = 1;
+    xTaskCreatePinnedToCore(prox_sensor_task, "prox_sensor", 3072, NULL,
+                            uxTaskPriorityGet(NULL) + 1,
+                            &prox_sensor_task_handle,
+                            core < 0 ? tskNO_AFFINITY : core);
+    if (prox_sensor_task_handle == NULL) {
+        prox_sensor_task_running = 0;
+        vSemaphoreDelete(prox_sensor_task_done);
+        prox_sensor_task_done = NULL;
+        return 0;
+    }
+#if PROX_INT >= 0
+    gpio_config_t io_conf;
+    memset(&io_conf, 0, sizeof(io_conf));
+    io_conf.intr_type = GPIO_INTR_NEGEDGE;
+    io_conf.mode = GPIO_MODE_INPUT;
+    io_conf.pin_bit_mask = 1ULL << PROX_INT;
+    io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
+    ESP_ERROR_CHECK(gpio_config(&io_conf));
+    gpio_install_isr_service(0);
+    ESP_ERROR_CHECK(gpio_isr_handler_add((gpio_num_t)PROX_INT,
+                                         prox_sensor_isr, NULL));
+#endif
     return 1;
 }
+void prox_sensor_task_deinitialize(void) {
+    if (!prox_sensor_task_running) {
+        return;
+    }
+#if PROX_INT >= 0
+    gpio_isr_handler_remove((gpio_num_t)PROX_INT);
+#endif
+    prox_sensor_task_running = 0;
+    xTaskNotifyGive(prox_sensor_task_handle);
+    xSemaphoreTake(prox_sensor_task_done, portMAX_DELAY);
+    vSemaphoreDelete(prox_sensor_task_done);
+    prox_sensor_task_done = NULL;
+    prox_sensor_task_handle = NULL;
+#if PROX_INT >= 0
+    // only now, or a power switch on the way out could turn it back on
+    xSemaphoreTake(prox_sensor_mutex, portMAX_DELAY);
+    prox_sensor_set_reg(0x02, 0x00);
+    ESP_ERROR_CHECK(prox_sensor_commit());
+    xSemaphoreGive(prox_sensor_mutex);
+#endif
+}
 
 static uint8_t prox_sensor_part_id(void) {
     uint8_t result;
-    prox_sensor_read_reg(0xFF, &result,1);
+    ESP_ERROR_CHECK(prox_sensor_read_reg(0xFF, &result, 1));
     return result;
 }
 
@@ -1298,37 +3607,79 @@ void prox_sensor_initialize(void) {
     if(prox_sensor_part_id()!=0x15) {
         ESP_ERROR_CHECK (ESP_ERR_INVALID_RESPONSE);
     }
+    if (prox_sensor_mutex == NULL) {
+        prox_sensor_mutex =
+            xSemaphoreCreateMutexStatic(&prox_sensor_mutex_buffer);
+    }
+    prox_sensor_shadow_load();
+    prox_presence_initialize(&prox_sensor_presence_state,
+                             PROX_PRESENCE_ENTER_DEFAULT,
+                             PROX_PRESENCE_EXIT_DEFAULT,
+                             PROX_PRESENCE_FULL_SCALE_DEFAULT);
     prox_sensor_initialized=true;
 }
 void prox_sensor_deinitialize(void) {
     if (!prox_sensor_initialized) {
         return;
     }
+    prox_sensor_task_deinitialize();
+    prox_sensor_buffer(0);
+    prox_sensor_initialized = false;
 }
 
 void prox_sensor_pulse_amp_threshold(int16_t red, int16_t ir, int16_t green, int16_t prox, int16_t thresh) {
     if(!prox_sensor_initialized) {
         return;
     }
+    xSemaphoreTake(prox_sensor_mutex, portMAX_DELAY);
+    if (prox_sensor_idle) {
+        // wake up, so these land on the active values. they're what it
+        // comes back to after the next idle spell
+        prox_sensor_power(0);
+        prox_sensor_activity_us = esp_timer_get_time();
+    }
     if(red>=0&&red<=0xFF) {
-        prox_sensor_write_reg(0x0C,red);
+        prox_sensor_set_reg(0x0C,red);
     }
     if(ir>=0&&ir<=0xFF) {
-        prox_sensor_write_reg(0x0D,ir);
+        prox_sensor_set_reg(0x0D,ir);
     }
     if(green>=0&&green<=0xFF) {
-        prox_sensor_write_reg(0x0E,green);
+        prox_sensor_set_reg(0x0E,green);
     }
     if(prox>=0&&prox<=0xFF) {
-        prox_sensor_write_reg(0x10,prox);
+        prox_sensor_set_reg(0x10,prox);
     }
     if(thresh>=0&&thresh<=0xFF) {
-        prox_sensor_write_reg(0x30,thresh);
+        prox_sensor_set_reg(0x30,thresh);
     }
+    ESP_ERROR_CHECK(prox_sensor_commit());
+    xSemaphoreGive(prox_sensor_mutex);
 }
 static int sd_initialized = 0;
 static sdmmc_card_t *sd_card_handle = NULL;
 static const char* sd_mount_point = NULL;
+static size_t sd_alloc_unit = 0;
+// the card's real cluster size. allocation_unit_size only applies if the
+// mount had to format the card, so ask FATFS what it actually found
+static size_t sd_cluster_size(sdmmc_card_t* card) {
+    const BYTE pdrv = ff_diskio_get_pdrv_card(card);
+    if (pdrv == 0xFF) {
+        return 0;
+    }
+    char path[4] = {(char)('0' + pdrv), ':', '/', 0};
+    FF_DIR dir;
+    if (FR_OK != f_opendir(&dir, path)) {
+        return 0;
+    }
+#if FF_MAX_SS != FF_MIN_SS
+    const size_t result = (size_t)dir.obj.fs->csize * dir.obj.fs->ssize;
+#else
+    const size_t result = (size_t)dir.obj.fs->csize * FF_MAX_SS;
+#endif
+    f_closedir(&dir);
+    return result;
+}
 int sd_initialize(const char* mount_point, size_t max_files, size_t alloc_unit_size, uint32_t freq, int flags) {
     if(sd_initialized) {
         return 1;
@@ -1354,6 +3705,10 @@ int sd_initialize(const char* mount_point, size_t max_files, size_t alloc_unit_s
         return 0;
     }
     sd_mount_point = mount_point;
+    sd_alloc_unit = sd_cluster_size(sd_card_handle);
+    if (sd_alloc_unit == 0) {
+        sd_alloc_unit = alloc_unit_size;
+    }
     sd_initialized=1;
     return 1;
 }
@@ -1371,4 +3726,315 @@ sdmmc_card_t* sd_card() {
         return NULL;
     }
     return sd_card_handle;
-}
\ No newline at end of file
+}
+
+// The recorder streams JPEG frames from the camera into an MJPEG file (just
+// the JPEGs back to back) along with an index of where each one starts.
+// Both are unbuffered and written in whole chunks, normally the card's
+// cluster size, so FAT never has to read-modify-write a cluster.
+typedef struct {
+    FILE* file;
+    uint8_t* chunk;
+    size_t used;
+} camera_record_stream_t;
+static camera_record_stream_t camera_record_video = {NULL, NULL, 0};
+static camera_record_stream_t camera_record_index = {NULL, NULL, 0};
+static size_t camera_record_chunk_size = 0;
+static uint32_t camera_record_offset = 0;
+static uint32_t camera_record_interval = 0;
+static volatile int camera_recording = 0;
+static volatile uint32_t camera_record_count = 0;
+static volatile int camera_record_error = 0;
+static SemaphoreHandle_t camera_record_done = NULL;
+// JPEG mode has no camera_lcd_flush(), so the recorder decodes a reduced
+// preview every so often. It rotates through three buffers: the one it's
+// decoding into, the newest finished one, and the one going out to the LCD.
+static int camera_record_scale = 4;
+static uint32_t camera_record_every = 0;
+// with a hold time, motion detection runs on every decoded preview, and
+// frames are only written while it sees something and for hold_ms after
+static uint32_t camera_record_hold_ms = 0;
+static uint8_t* camera_record_previews[3] = {NULL, NULL, NULL};
+static int camera_record_preview_write = 0;
+static int camera_record_preview_ready = 1;
+static int camera_record_preview_sent = 2;
+static int camera_record_preview_new = 0;
+static uint16_t camera_record_preview_dim = 0;
+static uint32_t camera_record_preview_sequence = 0;
+static portMUX_TYPE camera_record_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int camera_record_write(camera_record_stream_t* stream,
+                               const void* data, size_t size) {
+    const uint8_t* in = (const uint8_t*)data;
+    while (size) {
+        size_t to_copy = camera_record_chunk_size - stream->used;
+        if (to_copy > size) {
+            to_copy = size;
+        }
+        memcpy(stream->chunk + stream->used, in, to_copy);
+        stream->used += to_copy;
+        in += to_copy;
+        size -= to_copy;
+        if (stream->used == camera_record_chunk_size) {
+            if (1 != fwrite(stream->chunk, camera_record_chunk_size, 1,
+                            stream->file)) {
+                return 0;
+            }
+            stream->used = 0;
+        }
+    }
+    return 1;
+}
+// the tail end is the only partial chunk we ever write
+static int camera_record_finish(camera_record_stream_t* stream) {
+    if (stream->used > 0 &&
+        1 != fwrite(stream->chunk, stream->used, 1, stream->file)) {
+        return 0;
+    }
+    stream->used = 0;
+    return 1;
+}
+// decode fb into the write buffer at the preview scale. returns 0 if it
+// didn't decode
+static int camera_record_decode(const camera_fb_t* fb) {
+    static const jpg_scale_t scales[] = {JPG_SCALE_NONE, JPG_SCALE_2X,
+                                         JPG_SCALE_4X, JPG_SCALE_8X};
+    if (fb->width / camera_record_scale != camera_record_preview_dim ||
+        fb->height != fb->width) {
+        return 0;
+    }
+    return jpg2rgb565(
+        fb->buf, fb->len,
+        camera_record_previews[camera_record_preview_write],
+        scales[camera_record_scale == 8 ? 3 : camera_record_scale >> 1]);
+}
+static void camera_record_task(void* arg) {
+    TickType_t next = xTaskGetTickCount();
+    uint32_t frame_no = 0;
+    const int64_t hold_us = (int64_t)camera_record_hold_ms * 1000;
+    // nothing's moved yet
+    int64_t motion_us = esp_timer_get_time() - hold_us - 1;
+    while (camera_recording) {
+        camera_fb_t* fb = esp_camera_fb_get();
+        if (fb == NULL) {
+            continue;
+        }
+        const int show = camera_record_every > 0 &&
+                         frame_no++ % camera_record_every == 0;
+        const int decoded = (show || hold_us > 0) && camera_record_decode(fb);
+        if (decoded && hold_us > 0 &&
+            camera_motion_update(
+                camera_record_previews[camera_record_preview_write],
+                camera_record_preview_dim, camera_record_preview_dim, 0) > 0) {
+            motion_us = esp_timer_get_time();
+        }
+        if (hold_us > 0 && esp_timer_get_time() - motion_us > hold_us) {
+            // a still scene. don't write it, but keep the preview going
+            esp_camera_fb_return(fb);
+            fb = NULL;
+        }
+        if (decoded && show) {
+            // the jpeg decoder's RGB565 is big endian, like the sensor's
+            portENTER_CRITICAL(&camera_record_lock);
+            const int tmp = camera_record_preview_ready;
+            camera_record_preview_ready = camera_record_preview_write;
+            camera_record_preview_write = tmp;
+            camera_record_preview_new = 1;
+            portEXIT_CRITICAL(&camera_record_lock);
+        }
+        if (fb == NULL) {
+            // no faster than frames would have been written
+            if (camera_record_interval > 0) {
+                vTaskDelay(pdMS_TO_TICKS(camera_record_interval));
+                next = xTaskGetTickCount();
+            }
+            continue;
+        }
+        camera_record_index_t entry;
+        entry.offset = camera_record_offset;
+        entry.size = fb->len;
+        entry.timestamp_us =
+            (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+        int ok = camera_record_write(&camera_record_video, fb->buf, fb->len);
+        camera_record_offset += fb->len;
+        esp_camera_fb_return(fb);
+        if (ok) {
+            ok = camera_record_write(&camera_record_index, &entry,
+                                     sizeof(entry));
+        }
+        if (!ok) {
+            camera_record_error = 1;
+            break;
+        }
+        ++camera_record_count;
+        if (camera_record_interval > 0) {
+            next += pdMS_TO_TICKS(camera_record_interval);
+            TickType_t now = xTaskGetTickCount();
+            if ((int32_t)(next - now) > 0) {
+                vTaskDelay(next - now);
+            } else {
+                next = now;
+            }
+        }
+    }
+    xSemaphoreGive(camera_record_done);
+    vTaskDelete(NULL);
+}
+static void camera_record_stream_free(camera_record_stream_t* stream) {
+    if (stream->file != NULL) {
+        fclose(stream->file);
+        stream->file = NULL;
+    }
+    if (stream->chunk != NULL) {
+        free(stream->chunk);
+        stream->chunk = NULL;
+    }
+    stream->used = 0;
+}
+static void camera_record_free(void) {
+    camera_record_stream_free(&camera_record_video);
+    camera_record_stream_free(&camera_record_index);
+    if (camera_record_previews[0] != NULL) {
+        // the last preview may still be going out
+        lcd_wait_flush_sequence(camera_record_preview_sequence, 0);
+    }
+    for (int i = 0; i < 3; ++i) {
+        free(camera_record_previews[i]);
+        camera_record_previews[i] = NULL;
+    }
+    camera_record_preview_new = 0;
+    if (camera_record_done != NULL) {
+        vSemaphoreDelete(camera_record_done);
+        camera_record_done = NULL;
+    }
+}
+static int camera_record_stream_open(camera_record_stream_t* stream,
+                                     const char* path, size_t chunk_size) {
+    stream->used = 0;
+    stream->chunk = (uint8_t*)heap_caps_malloc(chunk_size, MALLOC_CAP_DMA);
+    stream->file = fopen(path, "wb");
+    if (stream->chunk == NULL || stream->file == NULL) {
+        return 0;
+    }
+    // we do our own buffering
+    setvbuf(stream->file, NULL, _IONBF, 0);
+    return 1;
+}
+int camera_record_start(const char* path, uint32_t interval_ms,
+                        size_t chunk_size) {
+    if (!camera_initialized || !(camera_flags & CAM_FORMAT_JPEG) ||
+        camera_recording || path == NULL) {
+        return 0;
+    }
+    if (chunk_size == 0) {
+        chunk_size = sd_alloc_unit >= 4096 ? sd_alloc_unit : 16 * 1024;
+    }
+    char index_path[256];
+    if (sizeof(index_path) <=
+        (size_t)snprintf(index_path, sizeof(index_path), "%s.idx", path)) {
+        return 0;
+    }
+    if (camera_record_hold_ms > 0 && camera_motion_block == 0) {
+        // nothing to gate on
+        return 0;
+    }
+    camera_record_done = xSemaphoreCreateBinary();
+    if (camera_record_every > 0 || camera_record_hold_ms > 0) {
+        camera_record_preview_dim = camera_frame_dim() / camera_record_scale;
+        for (int i = 0; i < 3; ++i) {
+            camera_record_previews[i] = (uint8_t*)heap_caps_malloc(
+                camera_record_preview_dim * camera_record_preview_dim * 2,
+                MALLOC_CAP_DMA);
+            if (camera_record_previews[i] == NULL) {
+                camera_record_free();
+                return 0;
+            }
+        }
+        camera_record_preview_write = 0;
+        camera_record_preview_ready = 1;
+        camera_record_preview_sent = 2;
+        camera_record_preview_new = 0;
+    }
+    if (camera_record_done == NULL ||
+        !camera_record_stream_open(&camera_record_video, path, chunk_size) ||
+        !camera_record_stream_open(&camera_record_index, index_path,
+                                   chunk_size)) {
+        camera_record_free();
+        return 0;
+    }
+    camera_record_chunk_size = chunk_size;
+    camera_record_offset = 0;
+    camera_record_interval = interval_ms;
+    camera_record_count = 0;
+    camera_record_error = 0;
+    camera_recording = 1;
+    TaskHandle_t handle = NULL;
+    xTaskCreate(camera_record_task, "camera_record", 4096, NULL,
+                uxTaskPriorityGet(NULL), &handle);
+    if (handle == NULL) {
+        camera_recording = 0;
+        camera_record_free();
+        return 0;
+    }
+    return 1;
+}
+int camera_record_stop(void) {
+    if (!camera_recording && camera_record_done == NULL) {
+        return 0;
+    }
+    camera_recording = 0;
+    xSemaphoreTake(camera_record_done, portMAX_DELAY);
+    int result = !camera_record_error &&
+                 camera_record_finish(&camera_record_video) &&
+                 camera_record_finish(&camera_record_index);
+    camera_record_free();
+    return result;
+}
+uint32_t camera_record_frames(void) { return camera_record_count; }
+int camera_record_preview(int scale, uint32_t every) {
+    if (camera_recording || (every > 0 && scale != 2 && scale != 4 &&
+                             scale != 8)) {
+        return 0;
+    }
+    if (every > 0) {
+        camera_record_scale = scale;
+    }
+    camera_record_every = every;
+    return 1;
+}
+int camera_record_motion(uint32_t hold_ms) {
+    if (camera_recording) {
+        return 0;
+    }
+    camera_record_hold_ms = hold_ms;
+    return 1;
+}
+int camera_record_lcd_flush(uint16_t x, uint16_t y) {
+    if (!camera_recording || camera_record_previews[0] == NULL ||
+        lcd_spi_handle == NULL) {
+        return 0;
+    }
+    // the one we sent last time goes back to the recorder, so it has to
+    // be out of the SPI queue first
+    lcd_wait_flush_sequence(camera_record_preview_sequence, 0);
+    portENTER_CRITICAL(&camera_record_lock);
+    const int fresh = camera_record_preview_new;
+    if (fresh) {
+        const int tmp = camera_record_preview_sent;
+        camera_record_preview_sent = camera_record_preview_ready;
+        camera_record_preview_ready = tmp;
+        camera_record_preview_new = 0;
+    }
+    portEXIT_CRITICAL(&camera_record_lock);
+    if (!fresh) {
+        return 0;
+    }
+    if (!lcd_flush_rotated_impl(
+            x, y, camera_record_preview_dim, camera_record_preview_dim,
+            camera_record_previews[camera_record_preview_sent],
+            camera_pixel_rotation(), 3)) {
+        return 0;
+    }
+    camera_record_preview_sequence = lcd_flush_sequence();
+    return 1;
+}
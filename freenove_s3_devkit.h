@@ -4,11 +4,22 @@
 #include <stddef.h>
 #include "esp_attr.h"
 #include "driver/sdmmc_types.h"
+#include "freenove_s3_devkit_core.h"
 enum {
     CAM_DEFAULT = 0,
     CAM_ALLOC_FB_PSRAM=(1<<0),
     CAM_ALLOC_CAM_PSRAM=(1<<1),
-    CAM_FRAME_SIZE_96X96=(1<<2)
+    CAM_FRAME_SIZE_96X96=(1<<2),
+    // don't allocate a frame buffer copy. use camera_lcd_flush() instead
+    CAM_DIRECT_LCD=(1<<3),
+    // frames from camera_frame_buffer() and the pipeline are 8-bit luma
+    CAM_OUTPUT_LUMA=(1<<4),
+    // capture JPEGs from the sensor for camera_record_start(). there's no
+    // camera_lcd_flush() in this mode, only the recorder's reduced preview
+    // from camera_record_lcd_flush()
+    CAM_FORMAT_JPEG=(1<<5),
+    // track frame latency and drops for camera_profile()
+    CAM_PROFILE=(1<<6)
 };
 typedef enum {
     CAM_NO_CHANGE = -3,
@@ -23,6 +34,9 @@ enum {
     TOUCH_THRESH_DEFAULT = 32
 };
 
+#ifndef TOUCH_EVENT_QUEUE_SIZE
+#define TOUCH_EVENT_QUEUE_SIZE 32
+#endif
 typedef enum {
     AUDIO_44_1K_STEREO=0,
     AUDIO_44_1K_MONO,
@@ -130,6 +144,79 @@ enum {
 
 #define AUDIO_MAX_SAMPLES 1024
 
+// the number of SPI transactions the LCD can have in flight. a flush is
+// up to 6 of them, so this is how deep flushes can be queued back to back
+#ifndef LCD_TRANS_QUEUE_SIZE
+#define LCD_TRANS_QUEUE_SIZE 32
+#endif
+
+typedef struct {
+    uint16_t x1, y1, x2, y2;
+    // the sum of the mean per pixel difference of each block in the box
+    uint32_t score;
+} camera_motion_box_t;
+
+// driver settings for camera_initialize_settings()
+typedef struct {
+    // frame buffers the driver captures into
+    size_t fb_count;
+    // nonzero always hands back the newest frame for the lowest latency.
+    // zero hands back every frame in order for the highest throughput
+    int grab_latest;
+    uint32_t xclk_hz;
+    int fb_in_psram;
+    // 0-63, lower is better. only used with CAM_FORMAT_JPEG
+    int jpeg_quality;
+} camera_settings_t;
+
+// how frames fared on their way to the caller. latency runs from capture to
+// when the frame was handed over, or for camera_lcd_flush(), to when it
+// finished going out to the panel
+typedef struct {
+    uint32_t frames;
+    uint32_t dropped;
+    uint32_t latency_min_us;
+    uint32_t latency_avg_us;
+    uint32_t latency_max_us;
+} camera_profile_t;
+
+// where a frame was, as of when it was handed to the caller
+typedef struct {
+    // when the sensor captured it, in esp_timer time
+    int64_t timestamp_us;
+    // counts every frame the sensor produced, including the ones we missed
+    uint32_t sequence;
+    // frames the caller never saw since the one before this
+    uint32_t dropped;
+} camera_frame_info_t;
+
+// the legs of a frame's trip, for camera_latency_histogram()
+typedef enum {
+    // sensor capture to the driver handing us the frame
+    CAMERA_STAGE_CAPTURE = 0,
+    // copying, cropping and rotating, or queuing a camera_lcd_flush()
+    CAMERA_STAGE_PROCESS,
+    // done processing to the caller getting it, or to the flush finishing
+    CAMERA_STAGE_DELIVER,
+    // capture to delivery
+    CAMERA_STAGE_TOTAL,
+    CAMERA_STAGE_COUNT
+} camera_stage_t;
+// bucket i counts latencies under 2^i ms, and the last one the rest
+#define CAMERA_HISTOGRAM_BUCKETS 12
+
+// one entry per frame in a recording's .idx file
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+    int64_t timestamp_us;
+} camera_record_index_t;
+
+typedef struct {
+    lcd_rect_t bounds;
+    const void* bitmap;
+} lcd_region_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -139,22 +226,133 @@ extern IRAM_ATTR void lcd_on_flush_complete(void) __attribute__((weak));
 extern void lcd_initialize(size_t max_transfer_size);
 extern void lcd_rotation(int rotation);
 extern void lcd_flush(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2, const void* bitmap);
+// queue several regions at once. lcd_on_flush_complete() is called once,
+// after the last one has been sent
+extern void lcd_flush_batch(const lcd_region_t* regions, size_t count);
+// flush a w x h bitmap at (x, y) rotated by rotation, by switching the
+// panel's scan direction for that window rather than moving pixels. returns
+// 0 if the rotated bitmap doesn't fit on the panel at (x, y)
+extern int lcd_flush_rotated(uint16_t x, uint16_t y, uint16_t w, uint16_t h, const void* bitmap, int rotation);
+// wait for everything queued so far to be sent. timeout is in ms, 0 waits forever
 extern int lcd_wait_flush(uint32_t timeout);
+// the sequence number of the most recently queued flush or batch
+extern uint32_t lcd_flush_sequence(void);
+// nonzero if the given flush and everything before it has been sent
+extern int lcd_flush_done(uint32_t sequence);
+// block (without spinning) until the given flush has been sent. several tasks
+// can wait at once
+extern int lcd_wait_flush_sequence(uint32_t sequence, uint32_t timeout);
 extern void lcd_deinitialize(void);
+// the number of LCD commands sent and the number skipped because the
+// controller already had that window or address mode
+extern void lcd_command_stats(uint32_t* out_sent, uint32_t* out_elided, int reset);
+// queue a dirty rectangle for the flush planner
+extern void lcd_dirty_add(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2);
+// coalesce the queued rectangles into as few flush windows as is cheaper to
+// send, given the measured SPI command overhead. clears the queue.
+extern size_t lcd_dirty_plan(lcd_rect_t* out_rects, size_t max_rects);
+// the measured cost of setting up a flush window, in pixels
+extern uint32_t lcd_window_cost(void);
+
+#define NEOPIXEL_MAX_KEYFRAMES 16
+typedef enum {
+    NEOPIXEL_EASE_LINEAR = 0,
+    NEOPIXEL_EASE_IN,
+    NEOPIXEL_EASE_OUT,
+    NEOPIXEL_EASE_IN_OUT,
+    // jump at the end of the keyframe
+    NEOPIXEL_EASE_STEP
+} neopixel_easing_t;
+// fade to this color over duration_ms
+typedef struct {
+    uint32_t duration_ms;
+    uint8_t r, g, b;
+    uint8_t easing;
+} neopixel_keyframe_t;
+
+// queue a write then read (either may be empty) on the shared I2C bus.
+// write and read must stay valid until callback is called, except writes of
+// 4 bytes or less, which are copied. timeout is in ms
+extern int i2c_bus_submit(uint8_t address, const uint8_t* write, size_t write_len,
+                          uint8_t* read, size_t read_len, i2c_priority_t priority,
+                          uint32_t timeout, i2c_bus_callback_t callback, void* state);
+// the same, but waits for it to finish
+extern esp_err_t i2c_bus_transfer(uint8_t address, const uint8_t* write, size_t write_len,
+                                  uint8_t* read, size_t read_len, i2c_priority_t priority,
+                                  uint32_t timeout);
+extern void i2c_bus_stats(uint8_t address, i2c_bus_stats_t* out_stats, int reset);
 
 extern void led_initialize(void);
 extern void led_enable(int enabled);
 extern void led_deinitialize(void);
 
 extern void camera_initialize(int flags);
+// fill in the settings camera_initialize() would use for these flags
+extern void camera_default_settings(int flags, camera_settings_t* out_settings);
+extern void camera_initialize_settings(int flags, const camera_settings_t* settings);
+// requires CAM_PROFILE
+extern void camera_profile(camera_profile_t* out_profile, int reset);
+// fills out_buckets with CAMERA_HISTOGRAM_BUCKETS counts. requires CAM_PROFILE
+extern void camera_latency_histogram(camera_stage_t stage, uint32_t* out_buckets, int reset);
+// info for a frame from camera_frame_buffer() or camera_acquire_frame(), or
+// with NULL, for the last frame sent by camera_lcd_flush()
+extern int camera_frame_info(const void* frame, camera_frame_info_t* out_info);
 extern void camera_levels(int brightness, int contrast,
                    int saturation, int sharpness);
 extern void camera_rotation(int rotation);
 extern const void* camera_frame_buffer(void);
+// crop frames to the given region and box filter them down to out_width x
+// out_height as they're copied out of the camera. a width of 0 turns it off.
+// call after camera_initialize(), since the region is checked against the
+// frame size
+extern int camera_roi(int x, int y, int width, int height, int out_width, int out_height);
+// convert count big endian RGB565 pixels to 8-bit luma. src and dst may be the same
+extern void camera_luma(const void* src, void* dst, size_t count);
+// the dimensions of the frames camera_frame_buffer() returns
+extern void camera_frame_size(int* out_width, int* out_height);
+// compare frames against a running background in block_size square blocks,
+// flagging blocks whose mean difference is at least threshold. once
+// initialized the pipeline runs it on every frame it converts
+extern int camera_motion_initialize(int block_size, int threshold);
+extern void camera_motion_deinitialize(void);
+// run motion detection on a frame, which is 8-bit luma if luma is nonzero,
+// otherwise RGB565. returns the number of boxes found. frames of more than
+// 65535 blocks aren't supported and find none
+extern size_t camera_motion_update(const void* frame, int width, int height, int luma);
+// the boxes from the last frame, strongest first
+extern size_t camera_motion_boxes(camera_motion_box_t* out_boxes, size_t max_boxes);
+// the total motion in the last frame
+extern uint32_t camera_motion_score(void);
+// send the latest frame straight from the camera to the LCD with its top
+// left at (x, y). the frame is handed back to the camera once it's been sent
+extern int camera_lcd_flush(uint16_t x, uint16_t y);
 extern void camera_deinitialize(void);
+// capture and convert frames on a background task into a ring of
+// buffer_count buffers. core is the core to run on, or -1 for any
+extern int camera_pipeline_initialize(size_t buffer_count, int core);
+// stop the pipeline. anyone waiting in camera_acquire_frame() gets NULL, and
+// this waits for every acquired frame to be released before freeing them,
+// so don't call it from a task that's still holding one
+extern void camera_pipeline_deinitialize(void);
+// check out the newest converted frame. timeout is in ms, 0 waits forever
+extern const void* camera_acquire_frame(uint32_t timeout);
+// hand a frame from camera_acquire_frame() back to the pipeline
+extern void camera_release_frame(const void* frame);
+// the number of frames converted but never acquired
+extern uint32_t camera_dropped_frames(int reset);
 
 extern void neopixel_initialize(void);
+// for count LEDs daisy chained off the NeoPixel pin
+extern void neopixel_initialize_chain(size_t count);
+// set every LED, stopping any animation. doesn't wait on the LEDs
 extern void neopixel_color(uint8_t r, uint8_t g, uint8_t b);
+// set one LED. nothing changes until neopixel_show()
+extern void neopixel_set(size_t index, uint8_t r, uint8_t g, uint8_t b);
+extern void neopixel_show(void);
+// fade every LED through keyframes on the NeoPixel task, starting from the
+// first LED's current color. loop starts over from the last keyframe
+extern int neopixel_animate(const neopixel_keyframe_t* keyframes, size_t count, int loop);
+extern void neopixel_stop(void);
 extern void neopixel_deinitialize(void);
 
 extern void touch_initialize(int threshhold);
@@ -162,6 +360,17 @@ extern void touch_rotation(int rotation);
 extern int touch_xy(uint16_t* out_x, uint16_t* out_y);
 extern int touch_xy2(uint16_t* out_x, uint16_t* out_y);
 extern void touch_deinitialize(void);
+// read touches on a background task and queue them up as events. without
+// the INT line the panel is checked every idle_poll_ms, 0 for the default.
+// touch_xy() and touch_xy2() then return the task's latest without I2C
+extern int touch_events_initialize(uint32_t idle_poll_ms);
+extern void touch_events_deinitialize(void);
+// pop the oldest event. returns 0 if there isn't one
+extern int touch_event_read(touch_event_t* out_event);
+// events lost because the queue was full
+extern uint32_t touch_events_dropped(int reset);
+// pop the oldest gesture from the event task. returns 0 if there isn't one
+extern int touch_gesture_read(touch_gesture_t* out_gesture);
 
 extern void audio_initialize(audio_format_t format);
 extern void audio_deinitialize(void);
@@ -173,12 +382,55 @@ extern void prox_sensor_deinitialize(void);
 extern void prox_sensor_configure(prox_sens_amp_t powerLevel, prox_sens_sampleavg_t sampleAverage, prox_sens_mode_t mode ,
            prox_sens_samplerate_t sampleRate, prox_sens_pulsewidth_t pulseWidth , prox_sens_adcrange_t adcRange);
 extern int prox_sensor_read_raw(uint32_t* out_red, uint32_t* out_ir, uint32_t* out_green, uint32_t timeout);
+// hold up to capacity samples between reads. 0 goes back to the default
+extern int prox_sensor_buffer(size_t capacity);
+// drain up to max_samples, oldest first. waits up to timeout ms if there
+// are none, and 0 returns straight away with whatever's there
+extern size_t prox_sensor_read_many(prox_sample_t* out_samples, size_t max_samples, uint32_t timeout);
+// samples overwritten before anyone read them, plus polls lost to a failed
+// bus transfer. those are retried on the next poll
+extern uint32_t prox_sensor_dropped(int reset);
+// whether something's in front of the sensor. level runs from 0 to 1 as it
+// gets closer, and distance is -1 until calibrated or when nothing's there
+extern int prox_sensor_presence(float* out_level, float* out_distance_mm);
+// call with something held distance_mm away
+extern int prox_sensor_presence_calibrate(float distance_mm);
+extern void prox_sensor_presence_tune(float enter, float exit, float full_scale);
+// drop to a low sample rate and LED current once nothing has changed for
+// idle_ms, and come back up as soon as something does. 0 turns it off.
+// samples taken at the lower current are scaled up to what they'd read at
+// full power, so they lose a couple of bits but keep their level
+extern int prox_sensor_adaptive(uint32_t idle_ms);
+
+// empty the sensor's FIFO on a background task. core is the core to run
+// on, or -1 for any
+extern int prox_sensor_task_initialize(int core);
+extern void prox_sensor_task_deinitialize(void);
 extern void prox_sensor_pulse_amp_threshold(int16_t red, int16_t ir, int16_t green, int16_t prox,int16_t thresh);
 
 extern int sd_initialize(const char* mount_point, size_t max_files, size_t allocation_unit_size, uint32_t freq_khz, int flags);
 extern void sd_deinitialize();
 extern sdmmc_card_t* sd_card();
 
+// record JPEG frames to path on the SD as MJPEG, with an index at path.idx.
+// interval_ms spaces frames out for time lapse, 0 records every frame.
+// chunk_size is the write size, 0 for the card's cluster size
+extern int camera_record_start(const char* path, uint32_t interval_ms, size_t chunk_size);
+extern int camera_record_stop(void);
+extern uint32_t camera_record_frames(void);
+// while recording, decode every nth frame at 1/scale size (2, 4 or 8) for
+// camera_record_lcd_flush(). every of 0 turns it off. call before
+// camera_record_start()
+extern int camera_record_preview(int scale, uint32_t every);
+// send the newest preview to the LCD with its top left at (x, y). returns 0
+// if there isn't a new one since the last call
+extern int camera_record_lcd_flush(uint16_t x, uint16_t y);
+// only write frames while camera_motion_initialize()'s detector sees
+// something in the preview, and for hold_ms after. every frame is decoded
+// for it at the preview scale. 0 writes every frame. call before
+// camera_record_start()
+extern int camera_record_motion(uint32_t hold_ms);
+
 #ifdef __cplusplus
 }
 #endif
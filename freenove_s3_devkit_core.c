@@ -0,0 +1,647 @@
+#include "freenove_s3_devkit_core.h"
+#include <math.h>
+#include <string.h>
+
+uint32_t lcd_rect_area(const lcd_rect_t* rect) {
+    return (uint32_t)(rect->x2 - rect->x1 + 1) * (rect->y2 - rect->y1 + 1);
+}
+static void lcd_rect_union(const lcd_rect_t* a, const lcd_rect_t* b,
+                           lcd_rect_t* out_rect) {
+    out_rect->x1 = a->x1 < b->x1 ? a->x1 : b->x1;
+    out_rect->y1 = a->y1 < b->y1 ? a->y1 : b->y1;
+    out_rect->x2 = a->x2 > b->x2 ? a->x2 : b->x2;
+    out_rect->y2 = a->y2 > b->y2 ? a->y2 : b->y2;
+}
+// the number of pixels we'd waste (or save, if negative) by sending the
+// bounding window of a and b instead of each separately
+static int32_t lcd_rect_merge_cost(const lcd_rect_t* a, const lcd_rect_t* b,
+                                   uint32_t window_cost) {
+    lcd_rect_t u;
+    lcd_rect_union(a, b, &u);
+    return (int32_t)lcd_rect_area(&u) -
+           (int32_t)(lcd_rect_area(a) + lcd_rect_area(b) + window_cost);
+}
+static void lcd_rect_remove(lcd_rect_t* rects, size_t count, size_t index) {
+    memmove(rects + index, rects + index + 1,
+            (count - index - 1) * sizeof(lcd_rect_t));
+}
+// merges the pair that costs the least to merge, even if it's a loss
+static size_t lcd_rect_merge_cheapest(lcd_rect_t* rects, size_t count,
+                                      uint32_t window_cost) {
+    if (count < 2) {
+        return count;
+    }
+    size_t best_i = 0, best_j = 1;
+    int32_t best = INT32_MAX;
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t j = i + 1; j < count; ++j) {
+            int32_t cost = lcd_rect_merge_cost(&rects[i], &rects[j],
+                                               window_cost);
+            if (cost < best) {
+                best = cost;
+                best_i = i;
+                best_j = j;
+            }
+        }
+    }
+    lcd_rect_union(&rects[best_i], &rects[best_j], &rects[best_i]);
+    lcd_rect_remove(rects, count, best_j);
+    return count - 1;
+}
+size_t lcd_coalesce_rects(lcd_rect_t* rects, size_t count,
+                          uint32_t window_cost) {
+    int merged = 1;
+    while (merged) {
+        merged = 0;
+        for (size_t i = 0; i < count && !merged; ++i) {
+            for (size_t j = i + 1; j < count; ++j) {
+                // overlapping and adjacent rectangles that line up cost
+                // nothing extra to merge, and disjoint ones are worth it if
+                // the gap is cheaper than another window
+                if (lcd_rect_merge_cost(&rects[i], &rects[j], window_cost) <=
+                    0) {
+                    lcd_rect_union(&rects[i], &rects[j], &rects[i]);
+                    lcd_rect_remove(rects, count--, j);
+                    merged = 1;
+                    break;
+                }
+            }
+        }
+    }
+    return count;
+}
+size_t lcd_plan_rects(lcd_rect_t* rects, size_t count, size_t max_rects,
+                      uint32_t window_cost) {
+    count = lcd_coalesce_rects(rects, count, window_cost);
+    while (count > max_rects && count > 1) {
+        count = lcd_rect_merge_cheapest(rects, count, window_cost);
+    }
+    return count;
+}
+
+// 16x16 RGB565 tiles are 512 bytes, which comfortably fits on the stack in
+// internal SRAM
+#define CAMERA_TILE 16
+// rotate by 90 or 270 a tile at a time. each tile is read a row at a time,
+// transposed in internal SRAM, and then written out a row at a time so we
+// never stride a whole output row per pixel in PSRAM
+static void camera_rotate_tiled(uint16_t* out, const uint16_t* in, int rows,
+                                int cols, int rotation) {
+    uint16_t tile[CAMERA_TILE][CAMERA_TILE];
+    for (int ty = 0; ty < rows; ty += CAMERA_TILE) {
+        const int th = (rows - ty) < CAMERA_TILE ? (rows - ty) : CAMERA_TILE;
+        for (int tx = 0; tx < cols; tx += CAMERA_TILE) {
+            const int tw =
+                (cols - tx) < CAMERA_TILE ? (cols - tx) : CAMERA_TILE;
+            int out_row, out_col;
+            if (rotation == 1) {
+                // out[(cols - x - 1) * rows + y]
+                for (int y = 0; y < th; ++y) {
+                    const uint16_t* src = in + (ty + y) * cols + tx;
+                    for (int x = 0; x < tw; ++x) {
+                        tile[tw - x - 1][y] = src[x];
+                    }
+                }
+                out_row = cols - tx - tw;
+                out_col = ty;
+            } else {
+                // out[x * rows + (rows - y - 1)]
+                for (int y = 0; y < th; ++y) {
+                    const uint16_t* src = in + (ty + y) * cols + tx;
+                    for (int x = 0; x < tw; ++x) {
+                        tile[x][th - y - 1] = src[x];
+                    }
+                }
+                out_row = tx;
+                out_col = rows - ty - th;
+            }
+            for (int r = 0; r < tw; ++r) {
+                memcpy(out + (out_row + r) * rows + out_col, tile[r],
+                       th * sizeof(uint16_t));
+            }
+        }
+    }
+}
+void camera_rotate(uint16_t* out, const uint16_t* in, int rows, int cols,
+                   int rotation) {
+    size_t count;
+    switch (rotation & 3) {
+        case 1:
+        case 3:
+            // rotate 90 or 270
+            camera_rotate_tiled(out, in, rows, cols, rotation & 3);
+            break;
+        case 2:
+            // rotate 180: the output is just the input backwards
+            count = rows * cols;
+            out += count;
+            while (count--) {
+                *(--out) = *(in++);
+            }
+            break;
+        default:  // case 0:
+            memcpy(out, in, rows * cols * sizeof(uint16_t));
+            break;
+    }
+}
+
+int camera_crop_scale(const void* src, int src_width, int src_height, int x,
+                      int y, int width, int height, void* dst, int dst_width,
+                      int dst_height) {
+    if (x < 0 || y < 0 || x + width > src_width || y + height > src_height ||
+        width <= 0 || height <= 0 || dst_width <= 0 || dst_height <= 0 ||
+        dst_width > width || dst_height > height || dst_width > 320) {
+        return 0;
+    }
+    // precompute the span of source columns each output column averages
+    uint16_t xspan[321];
+    for (int ox = 0; ox <= dst_width; ++ox) {
+        xspan[ox] = x + (ox * width) / dst_width;
+    }
+    const uint8_t* in = (const uint8_t*)src;
+    uint8_t* out = (uint8_t*)dst;
+    for (int oy = 0; oy < dst_height; ++oy) {
+        const int y1 = y + (oy * height) / dst_height;
+        const int y2 = y + ((oy + 1) * height) / dst_height;
+        for (int ox = 0; ox < dst_width; ++ox) {
+            const int x1 = xspan[ox], x2 = xspan[ox + 1];
+            uint32_t r = 0, g = 0, b = 0;
+            for (int sy = y1; sy < y2; ++sy) {
+                // the sensor's big endian RGB565 with green moved up out of
+                // the way leaves each channel room to grow: blue in bits 0-10,
+                // red in 11-20 and green in 21-31. that's enough to add up 32
+                // pixels in one register before the channels would collide
+                const uint8_t* p = in + (sy * src_width + x1) * 2;
+                int left = x2 - x1;
+                while (left > 0) {
+                    int run = left < 32 ? left : 32;
+                    left -= run;
+                    uint32_t sum = 0;
+                    while (run--) {
+                        const uint32_t v = ((uint32_t)p[0] << 8) | p[1];
+                        sum += (v & 0xF81F) | ((v & 0x07E0) << 16);
+                        p += 2;
+                    }
+                    r += (sum >> 11) & 0x3FF;
+                    g += sum >> 21;
+                    b += sum & 0x7FF;
+                }
+            }
+            const uint32_t n = (uint32_t)(x2 - x1) * (y2 - y1);
+            r = (r + n / 2) / n;
+            g = (g + n / 2) / n;
+            b = (b + n / 2) / n;
+            *(out++) = (uint8_t)((r << 3) | (g >> 3));
+            *(out++) = (uint8_t)((g << 5) | b);
+        }
+    }
+    return 1;
+}
+
+// The gesture recognizer only ever sees touch events and times, so it knows
+// nothing of the controller or the task that feeds it.
+#define TOUCH_SLOP 10
+#define TOUCH_LONG_PRESS_US (500 * 1000)
+#define TOUCH_TAP_US (300 * 1000)
+#define TOUCH_SWIPE_DISTANCE 40
+#define TOUCH_SWIPE_VELOCITY 200.0f
+void touch_gestures_reset(touch_gestures_t* gestures) {
+    memset(gestures, 0, sizeof(touch_gestures_t));
+}
+static touch_contact_t* touch_gestures_contact(touch_gestures_t* gestures,
+                                               uint8_t id, int down) {
+    touch_contact_t* free_contact = NULL;
+    for (size_t i = 0; i < 2; ++i) {
+        touch_contact_t* c = &gestures->contacts[i];
+        if (c->down && c->id == id) {
+            return c;
+        }
+        if (!c->down && free_contact == NULL) {
+            free_contact = c;
+        }
+    }
+    return down ? free_contact : NULL;
+}
+static float touch_gestures_spread(const touch_gestures_t* gestures) {
+    float dx = (float)gestures->contacts[0].x - gestures->contacts[1].x;
+    float dy = (float)gestures->contacts[0].y - gestures->contacts[1].y;
+    return sqrtf(dx * dx + dy * dy);
+}
+static int touch_gestures_past_slop(const touch_contact_t* c) {
+    int dx = (int)c->x - c->start_x;
+    int dy = (int)c->y - c->start_y;
+    return dx * dx + dy * dy > TOUCH_SLOP * TOUCH_SLOP;
+}
+size_t touch_gestures_feed(touch_gestures_t* gestures,
+                           const touch_event_t* event,
+                           touch_gesture_t* out_gestures,
+                           size_t max_gestures) {
+    size_t count =
+        touch_gestures_tick(gestures, event->timestamp_us, out_gestures,
+                            max_gestures);
+    touch_contact_t* c = touch_gestures_contact(
+        gestures, event->id, event->type == TOUCH_EVENT_DOWN);
+    if (c == NULL) {
+        return count;
+    }
+    touch_gesture_t gesture;
+    memset(&gesture, 0, sizeof(gesture));
+    gesture.timestamp_us = event->timestamp_us;
+    gesture.scale = 1.0f;
+    int emit = 0;
+    switch (event->type) {
+        case TOUCH_EVENT_DOWN:
+            memset(c, 0, sizeof(touch_contact_t));
+            c->id = event->id;
+            c->down = 1;
+            c->start_x = c->x = event->x;
+            c->start_y = c->y = event->y;
+            c->start_us = c->last_us = event->timestamp_us;
+            if (gestures->contacts[0].down && gestures->contacts[1].down) {
+                gestures->multi = 1;
+                gestures->pinch_start = touch_gestures_spread(gestures);
+            }
+            break;
+        case TOUCH_EVENT_MOVE: {
+            int64_t dt = event->timestamp_us - c->last_us;
+            if (dt > 0) {
+                // smooth out the controller's jitter
+                float vx = ((float)event->x - c->x) * 1000000.0f / dt;
+                float vy = ((float)event->y - c->y) * 1000000.0f / dt;
+                c->velocity_x = (c->velocity_x + vx) * 0.5f;
+                c->velocity_y = (c->velocity_y + vy) * 0.5f;
+            }
+            c->x = event->x;
+            c->y = event->y;
+            c->last_us = event->timestamp_us;
+            if (!c->moved && touch_gestures_past_slop(c)) {
+                c->moved = 1;
+            }
+            if (gestures->multi && gestures->contacts[0].down &&
+                gestures->contacts[1].down && gestures->pinch_start > 0) {
+                float spread = touch_gestures_spread(gestures);
+                if (fabsf(spread - gestures->pinch_start) > TOUCH_SLOP) {
+                    gesture.type = TOUCH_GESTURE_PINCH;
+                    gesture.x = (gestures->contacts[0].x +
+                                 gestures->contacts[1].x) / 2;
+                    gesture.y = (gestures->contacts[0].y +
+                                 gestures->contacts[1].y) / 2;
+                    gesture.scale = spread / gestures->pinch_start;
+                    emit = 1;
+                }
+            }
+        } break;
+        case TOUCH_EVENT_UP:
+            c->down = 0;
+            if (event->timestamp_us - c->last_us > TOUCH_TAP_US) {
+                // it sat still before letting go, so it wasn't flung
+                c->velocity_x = c->velocity_y = 0;
+            }
+            if (!gestures->multi && !c->long_pressed) {
+                int dx = (int)c->x - c->start_x;
+                int dy = (int)c->y - c->start_y;
+                float speed = sqrtf(c->velocity_x * c->velocity_x +
+                                    c->velocity_y * c->velocity_y);
+                gesture.x = c->start_x;
+                gesture.y = c->start_y;
+                if (!c->moved &&
+                    event->timestamp_us - c->start_us <= TOUCH_TAP_US) {
+                    gesture.type = TOUCH_GESTURE_TAP;
+                    emit = 1;
+                } else if (dx * dx + dy * dy >=
+                               TOUCH_SWIPE_DISTANCE * TOUCH_SWIPE_DISTANCE &&
+                           speed >= TOUCH_SWIPE_VELOCITY) {
+                    gesture.type = TOUCH_GESTURE_SWIPE;
+                    gesture.dx = (int16_t)dx;
+                    gesture.dy = (int16_t)dy;
+                    gesture.velocity_x = c->velocity_x;
+                    gesture.velocity_y = c->velocity_y;
+                    emit = 1;
+                }
+            }
+            if (!gestures->contacts[0].down && !gestures->contacts[1].down) {
+                gestures->multi = 0;
+            }
+            break;
+    }
+    if (emit && count < max_gestures) {
+        out_gestures[count++] = gesture;
+    }
+    return count;
+}
+size_t touch_gestures_tick(touch_gestures_t* gestures, int64_t now_us,
+                           touch_gesture_t* out_gestures,
+                           size_t max_gestures) {
+    size_t count = 0;
+    for (size_t i = 0; i < 2; ++i) {
+        touch_contact_t* c = &gestures->contacts[i];
+        if (c->down && !c->moved && !c->long_pressed && !gestures->multi &&
+            now_us - c->start_us >= TOUCH_LONG_PRESS_US) {
+            c->long_pressed = 1;
+            if (count < max_gestures) {
+                touch_gesture_t* gesture = &out_gestures[count++];
+                memset(gesture, 0, sizeof(touch_gesture_t));
+                gesture->timestamp_us = now_us;
+                gesture->type = TOUCH_GESTURE_LONG_PRESS;
+                gesture->x = c->start_x;
+                gesture->y = c->start_y;
+                gesture->scale = 1.0f;
+            }
+        }
+    }
+    return count;
+}
+
+// How many samples are waiting in the 32 deep FIFO. With rollover on, a
+// full FIFO has the pointers equal and the overflow counter ticking
+int prox_sensor_fifo_pending(uint8_t write_pointer, uint8_t overflow,
+                             uint8_t read_pointer) {
+    int result = (write_pointer - read_pointer) & 0x1F;
+    if (result == 0 && overflow != 0) {
+        result = 32;
+    }
+    return result;
+}
+// Unpack a burst of FIFO_DATA. Each sample is a 3 byte, big endian, 18 bit
+// reading per active LED, red first
+void prox_sensor_decode(const uint8_t* burst, int samples, int leds,
+                        prox_sample_t* out_samples) {
+    for (int i = 0; i < samples; ++i) {
+        uint32_t values[3] = {0, 0, 0};
+        for (int j = 0; j < leds; ++j) {
+            values[j] = (((uint32_t)burst[0] << 16) |
+                         ((uint32_t)burst[1] << 8) | burst[2]) &
+                        0x3FFFF;
+            burst += 3;
+        }
+        out_samples[i].red = values[0];
+        out_samples[i].ir = values[1];
+        out_samples[i].green = values[2];
+    }
+}
+
+// The configuration registers are shadowed. Field changes land in the
+// shadow and mark the register dirty, and the commit writes them in as few
+// transactions as it can
+void prox_shadow_reset(prox_shadow_t* shadow) {
+    memset(shadow, 0, sizeof(prox_shadow_t));
+}
+void prox_shadow_loaded(prox_shadow_t* shadow, uint8_t reg, size_t count) {
+    for (size_t i = 0; i < count && reg + i < PROX_SHADOW_SIZE; ++i) {
+        shadow->valid |= 1ULL << (reg + i);
+        shadow->dirty &= ~(1ULL << (reg + i));
+    }
+}
+void prox_shadow_set(prox_shadow_t* shadow, uint8_t reg, uint8_t value) {
+    if (reg >= PROX_SHADOW_SIZE) {
+        return;
+    }
+    const uint64_t bit = 1ULL << reg;
+    if ((shadow->valid & bit) && shadow->regs[reg] == value) {
+        return;
+    }
+    shadow->regs[reg] = value;
+    shadow->valid |= bit;
+    shadow->dirty |= bit;
+}
+int prox_shadow_mask(prox_shadow_t* shadow, uint8_t reg, uint8_t mask,
+                     uint8_t thing) {
+    if (reg >= PROX_SHADOW_SIZE || !(shadow->valid & (1ULL << reg))) {
+        return 0;
+    }
+    prox_shadow_set(shadow, reg, (shadow->regs[reg] & mask) | thing);
+    return 1;
+}
+int prox_shadow_commit(prox_shadow_t* shadow, prox_shadow_write_t write,
+                       void* state) {
+    uint8_t reg = 0;
+    while (shadow->dirty != 0 && reg < PROX_SHADOW_SIZE) {
+        if (!(shadow->dirty & (1ULL << reg))) {
+            ++reg;
+            continue;
+        }
+        uint8_t data[1 + PROX_SHADOW_SIZE];
+        size_t len = 0;
+        uint64_t run = 0;
+        data[0] = reg;
+        while (reg < PROX_SHADOW_SIZE && (shadow->dirty & (1ULL << reg))) {
+            data[++len] = shadow->regs[reg];
+            run |= 1ULL << reg;
+            ++reg;
+        }
+        const int result = write(data, len + 1, state);
+        if (result != 0) {
+            return result;
+        }
+        shadow->dirty &= ~run;
+    }
+    return 0;
+}
+
+// The presence estimator works on IR alone. A short median knocks out
+// single sample spikes, an IIR smooths what's left, and a slow baseline
+// follows the ambient level only while nothing is there, so whatever rises
+// above it is reflection off something close. Reflected light falls off with
+// the square of distance, which gives the distance once it's calibrated.
+#define PROX_PRESENCE_IIR 0.25f
+#define PROX_PRESENCE_BASELINE 0.005f
+void prox_presence_initialize(prox_presence_t* presence, float enter,
+                              float exit, float full_scale) {
+    memset(presence, 0, sizeof(prox_presence_t));
+    presence->enter = enter;
+    presence->exit = exit;
+    presence->full_scale = full_scale;
+}
+static uint32_t prox_presence_median(const prox_presence_t* presence) {
+    uint32_t sorted[PROX_PRESENCE_WINDOW];
+    size_t n = presence->window_count;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t v = presence->window[i];
+        size_t j = i;
+        while (j > 0 && sorted[j - 1] > v) {
+            sorted[j] = sorted[j - 1];
+            --j;
+        }
+        sorted[j] = v;
+    }
+    return sorted[n / 2];
+}
+void prox_presence_update(prox_presence_t* presence,
+                          const prox_sample_t* samples, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        presence->window[presence->window_index] = samples[i].ir;
+        presence->window_index =
+            (presence->window_index + 1) % PROX_PRESENCE_WINDOW;
+        if (presence->window_count < PROX_PRESENCE_WINDOW) {
+            ++presence->window_count;
+        }
+        float median = (float)prox_presence_median(presence);
+        if (presence->samples++ == 0) {
+            // assume nobody's there to start with
+            presence->filtered = median;
+            presence->baseline = median;
+        } else {
+            presence->filtered += (median - presence->filtered) * PROX_PRESENCE_IIR;
+        }
+        if (!presence->present || presence->filtered < presence->baseline) {
+            // ambient drifts slowly, but can always drop out from under us
+            float rate = presence->filtered < presence->baseline
+                             ? PROX_PRESENCE_IIR
+                             : PROX_PRESENCE_BASELINE;
+            presence->baseline += (presence->filtered - presence->baseline) * rate;
+        }
+        presence->signal = presence->filtered - presence->baseline;
+        if (presence->signal < 0) {
+            presence->signal = 0;
+        }
+        if (presence->present) {
+            presence->present = presence->signal > presence->exit;
+        } else {
+            presence->present = presence->signal >= presence->enter;
+        }
+    }
+}
+float prox_presence_level(const prox_presence_t* presence) {
+    if (presence->full_scale <= 0) {
+        return 0;
+    }
+    float result = presence->signal / presence->full_scale;
+    return result > 1.0f ? 1.0f : result;
+}
+float prox_presence_distance(const prox_presence_t* presence) {
+    if (presence->calibration <= 0 || presence->signal <= 0 ||
+        !presence->present) {
+        return -1;
+    }
+    return sqrtf(presence->calibration / presence->signal);
+}
+int prox_presence_calibrate(prox_presence_t* presence, float distance_mm) {
+    if (!presence->present || presence->signal <= 0 || distance_mm <= 0) {
+        return 0;
+    }
+    presence->calibration = presence->signal * distance_mm * distance_mm;
+    return 1;
+}
+
+void i2c_bus_sched_reset(i2c_bus_sched_t* sched, size_t max_batch) {
+    memset(sched, 0, sizeof(i2c_bus_sched_t));
+    if (max_batch < 1) {
+        max_batch = 1;
+    } else if (max_batch > I2C_BUS_MAX_BATCH) {
+        max_batch = I2C_BUS_MAX_BATCH;
+    }
+    sched->max_batch = max_batch;
+}
+int i2c_bus_sched_push(i2c_bus_sched_t* sched,
+                       const i2c_bus_request_t* request,
+                       i2c_priority_t priority) {
+    if ((int)priority < 0 || priority >= I2C_PRIORITY_COUNT ||
+        sched->counts[priority] == I2C_BUS_QUEUE_SIZE) {
+        return 0;
+    }
+    const size_t tail =
+        (sched->heads[priority] + sched->counts[priority]) % I2C_BUS_QUEUE_SIZE;
+    sched->queues[priority][tail] = *request;
+    ++sched->counts[priority];
+    return 1;
+}
+size_t i2c_bus_sched_next(i2c_bus_sched_t* sched,
+                          i2c_bus_request_t* out_batch) {
+    int queue = 0;
+    while (queue < I2C_PRIORITY_COUNT && sched->counts[queue] == 0) {
+        ++queue;
+    }
+    if (queue == I2C_PRIORITY_COUNT) {
+        return 0;
+    }
+    const i2c_bus_request_t* requests = sched->queues[queue];
+    size_t count = 0;
+    // only from the same queue, so nothing jumps ahead of a higher priority
+    while (count < sched->max_batch && sched->counts[queue] > 0) {
+        const i2c_bus_request_t* next = &requests[sched->heads[queue]];
+        if (count > 0 && next->address != out_batch[0].address) {
+            break;
+        }
+        out_batch[count++] = *next;
+        sched->heads[queue] = (sched->heads[queue] + 1) % I2C_BUS_QUEUE_SIZE;
+        --sched->counts[queue];
+    }
+    return count;
+}
+void i2c_bus_sched_execute(const i2c_bus_request_t* batch, size_t count,
+                           i2c_bus_executor_t executor, void* state,
+                           int* out_results) {
+    executor(batch, count, out_results, state);
+    if (count < 2) {
+        return;
+    }
+    int failed = 0;
+    for (size_t i = 0; i < count; ++i) {
+        failed |= out_results[i] != 0;
+    }
+    if (failed) {
+        // a joined batch fails as a whole, whoever NACKed
+        for (size_t i = 0; i < count; ++i) {
+            executor(&batch[i], 1, &out_results[i], state);
+        }
+    }
+}
+static i2c_bus_device_t* i2c_bus_sched_device(i2c_bus_sched_t* sched,
+                                               uint8_t address, int add) {
+    i2c_bus_device_t* result = NULL;
+    for (size_t i = 0; i < I2C_BUS_DEVICES; ++i) {
+        i2c_bus_device_t* device = &sched->devices[i];
+        if (device->address == address) {
+            return device;
+        }
+        if (add && device->address == 0 && result == NULL) {
+            result = device;
+        }
+    }
+    if (result != NULL) {
+        result->address = address;
+    }
+    return result;
+}
+void i2c_bus_sched_record(i2c_bus_sched_t* sched,
+                          const i2c_bus_request_t* request, int result,
+                          int64_t done_us) {
+    i2c_bus_device_t* device =
+        i2c_bus_sched_device(sched, request->address, 1);
+    if (device == NULL) {
+        return;
+    }
+    const uint32_t latency = (uint32_t)(done_us - request->queued_us);
+    i2c_bus_stats_t* stats = &device->stats;
+    ++stats->transactions;
+    if (result != 0) {
+        ++stats->errors;
+    } else {
+        stats->bytes_written += request->write_len;
+        stats->bytes_read += request->read_len;
+    }
+    device->latency_total += latency;
+    stats->latency_avg_us =
+        (uint32_t)(device->latency_total / stats->transactions);
+    if (latency > stats->latency_max_us) {
+        stats->latency_max_us = latency;
+    }
+}
+int i2c_bus_sched_stats(i2c_bus_sched_t* sched, uint8_t address,
+                        i2c_bus_stats_t* out_stats, int reset) {
+    i2c_bus_device_t* device = i2c_bus_sched_device(sched, address, 0);
+    if (device == NULL) {
+        if (out_stats != NULL) {
+            memset(out_stats, 0, sizeof(i2c_bus_stats_t));
+        }
+        return 0;
+    }
+    if (out_stats != NULL) {
+        *out_stats = device->stats;
+    }
+    if (reset) {
+        memset(&device->stats, 0, sizeof(device->stats));
+        device->latency_total = 0;
+    }
+    return 1;
+}
@@ -0,0 +1,236 @@
+#ifndef FREENOVE_S3_DEVKIT_CORE_H
+#define FREENOVE_S3_DEVKIT_CORE_H
+// The parts of the devkit driver that are pure computation. Nothing in here
+// touches ESP-IDF, so it builds and runs on a host too (see test/)
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+    uint16_t x1, y1, x2, y2;
+} lcd_rect_t;
+
+typedef enum {
+    TOUCH_EVENT_DOWN = 0,
+    TOUCH_EVENT_MOVE,
+    TOUCH_EVENT_UP
+} touch_event_type_t;
+typedef struct {
+    // when the controller was read, in esp_timer time
+    int64_t timestamp_us;
+    // rotated like touch_xy()
+    uint16_t x, y;
+    // which finger, as tracked by the controller
+    uint8_t id;
+    uint8_t type;
+} touch_event_t;
+
+typedef enum {
+    TOUCH_GESTURE_TAP = 0,
+    // fires once, while the finger is still down
+    TOUCH_GESTURE_LONG_PRESS,
+    TOUCH_GESTURE_SWIPE,
+    // fires on every move once two fingers have spread or closed enough
+    TOUCH_GESTURE_PINCH
+} touch_gesture_type_t;
+typedef struct {
+    int64_t timestamp_us;
+    uint8_t type;
+    // where it started, or for a pinch, the midpoint between the fingers
+    uint16_t x, y;
+    // how far a swipe went
+    int16_t dx, dy;
+    // how fast a swipe was going when it let go, in pixels per second
+    float velocity_x, velocity_y;
+    // for a pinch, the finger spread now over what it started at
+    float scale;
+} touch_gesture_t;
+
+// The gesture recognizer's state. It's fed nothing but touch events and
+// timestamps, so it can be run over recorded traces off the device
+typedef struct {
+    uint8_t id;
+    uint8_t down;
+    uint8_t moved;
+    uint8_t long_pressed;
+    uint16_t start_x, start_y;
+    uint16_t x, y;
+    int64_t start_us;
+    int64_t last_us;
+    float velocity_x, velocity_y;
+} touch_contact_t;
+typedef struct {
+    touch_contact_t contacts[2];
+    // set once two fingers are down, until they're all up
+    int multi;
+    float pinch_start;
+} touch_gestures_t;
+
+typedef struct {
+    // estimated from when the FIFO was read and the sample rate
+    int64_t timestamp_us;
+    uint32_t red;
+    uint32_t ir;
+    uint32_t green;
+} prox_sample_t;
+
+// the presence estimator's state. it's fed nothing but samples, so it can be
+// run over recorded traces off the device
+#define PROX_PRESENCE_WINDOW 5
+typedef struct {
+    uint32_t window[PROX_PRESENCE_WINDOW];
+    uint8_t window_count;
+    uint8_t window_index;
+    uint32_t samples;
+    float filtered;
+    float baseline;
+    // IR counts above the baseline
+    float signal;
+    int present;
+    // signal to become present, and to stop being present
+    float enter;
+    float exit;
+    // signal for a level of 1
+    float full_scale;
+    // signal times distance squared, 0 if uncalibrated
+    float calibration;
+} prox_presence_t;
+// defaults for IR at 50mA and an ADC range of 2048
+#define PROX_PRESENCE_ENTER_DEFAULT 100.0f
+#define PROX_PRESENCE_EXIT_DEFAULT 50.0f
+#define PROX_PRESENCE_FULL_SCALE_DEFAULT 1000.0f
+
+// the prox sensor's configuration registers, 0x00 through 0x30
+#define PROX_SHADOW_SIZE 0x31
+typedef struct {
+    uint8_t regs[PROX_SHADOW_SIZE];
+    // one bit per register
+    uint64_t valid;
+    uint64_t dirty;
+} prox_shadow_t;
+// writes data[0] as the start register and the rest to it and the ones
+// after. returns 0 (ESP_OK) on success
+typedef int (*prox_shadow_write_t)(const uint8_t* data, size_t len, void* state);
+
+typedef enum {
+    I2C_PRIORITY_HIGH = 0,
+    I2C_PRIORITY_NORMAL,
+    I2C_PRIORITY_LOW,
+    I2C_PRIORITY_COUNT
+} i2c_priority_t;
+typedef struct {
+    uint32_t transactions;
+    uint32_t errors;
+    uint32_t bytes_written;
+    uint32_t bytes_read;
+    // from being queued to being done
+    uint32_t latency_avg_us;
+    uint32_t latency_max_us;
+} i2c_bus_stats_t;
+// called from the bus task when a request finishes. result is an esp_err_t
+typedef void (*i2c_bus_callback_t)(int result, void* state);
+
+#define I2C_BUS_QUEUE_SIZE 8
+#define I2C_BUS_DEVICES 4
+#define I2C_BUS_INLINE 4
+#define I2C_BUS_MAX_BATCH 4
+typedef struct {
+    uint8_t address;
+    uint8_t inline_data[I2C_BUS_INLINE];
+    // NULL when the write travels in inline_data
+    const uint8_t* write;
+    size_t write_len;
+    uint8_t* read;
+    size_t read_len;
+    uint32_t timeout;
+    int64_t queued_us;
+    i2c_bus_callback_t callback;
+    void* state;
+} i2c_bus_request_t;
+typedef struct {
+    uint8_t address;
+    i2c_bus_stats_t stats;
+    uint64_t latency_total;
+} i2c_bus_device_t;
+// The bus scheduler's priority queues and per device stats. Whoever owns the
+// bus drives it and hands batches to an executor, so it runs just as well
+// against a simulated bus
+typedef struct {
+    i2c_bus_request_t queues[I2C_PRIORITY_COUNT][I2C_BUS_QUEUE_SIZE];
+    uint8_t heads[I2C_PRIORITY_COUNT];
+    uint8_t counts[I2C_PRIORITY_COUNT];
+    size_t max_batch;
+    i2c_bus_device_t devices[I2C_BUS_DEVICES];
+} i2c_bus_sched_t;
+// run count requests for one device back to back, and set each one's result,
+// 0 for success
+typedef void (*i2c_bus_executor_t)(const i2c_bus_request_t* requests, size_t count,
+                                   int* out_results, void* state);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern uint32_t lcd_rect_area(const lcd_rect_t* rect);
+// merge rects in place wherever sending the bounding window is no more
+// expensive than sending both. returns the new count
+extern size_t lcd_coalesce_rects(lcd_rect_t* rects, size_t count, uint32_t window_cost);
+// coalesce, and then if there are still more than max_rects, keep merging
+// whichever pair costs the least. returns the new count
+extern size_t lcd_plan_rects(lcd_rect_t* rects, size_t count, size_t max_rects, uint32_t window_cost);
+// copy a rows x cols RGB565 bitmap into out, rotated by rotation (0-3)
+// quarter turns. out must not overlap in
+extern void camera_rotate(uint16_t* out, const uint16_t* in, int rows, int cols, int rotation);
+// crop the given region of a big endian RGB565 bitmap and downscale it into dst.
+// returns 0 if the region doesn't fit in the bitmap
+extern int camera_crop_scale(const void* src, int src_width, int src_height, int x, int y, int width,
+                             int height, void* dst, int dst_width, int dst_height);
+extern void touch_gestures_reset(touch_gestures_t* gestures);
+// feed an event to the recognizer. returns how many gestures it produced
+extern size_t touch_gestures_feed(touch_gestures_t* gestures, const touch_event_t* event,
+                                  touch_gesture_t* out_gestures, size_t max_gestures);
+// call while fingers are down and nothing is moving, for long presses
+extern size_t touch_gestures_tick(touch_gestures_t* gestures, int64_t now_us,
+                                  touch_gesture_t* out_gestures, size_t max_gestures);
+// how many samples are waiting in the prox sensor's FIFO, from FIFO_WR_PTR,
+// OVF_COUNTER and FIFO_RD_PTR
+extern int prox_sensor_fifo_pending(uint8_t write_pointer, uint8_t overflow, uint8_t read_pointer);
+// unpack samples from a FIFO_DATA burst with leds (1-3) active
+extern void prox_sensor_decode(const uint8_t* burst, int samples, int leds, prox_sample_t* out_samples);
+extern void prox_presence_initialize(prox_presence_t* presence, float enter, float exit, float full_scale);
+extern void prox_presence_update(prox_presence_t* presence, const prox_sample_t* samples, size_t count);
+extern float prox_presence_level(const prox_presence_t* presence);
+extern float prox_presence_distance(const prox_presence_t* presence);
+extern int prox_presence_calibrate(prox_presence_t* presence, float distance_mm);
+// forget everything, as if the part had never been read
+extern void prox_shadow_reset(prox_shadow_t* shadow);
+// count registers from reg were just read into regs, so they're valid and
+// clean
+extern void prox_shadow_loaded(prox_shadow_t* shadow, uint8_t reg, size_t count);
+extern void prox_shadow_set(prox_shadow_t* shadow, uint8_t reg, uint8_t value);
+// keep the bits in mask and or in thing. returns 0 if reg isn't valid yet
+extern int prox_shadow_mask(prox_shadow_t* shadow, uint8_t reg, uint8_t mask, uint8_t thing);
+// one write per run of consecutive dirty registers, since the part
+// auto-increments. stops at the first failure, leaves that run dirty and
+// returns its result
+extern int prox_shadow_commit(prox_shadow_t* shadow, prox_shadow_write_t write, void* state);
+// empty the queues and stats. batches hold up to max_batch requests, at most
+// I2C_BUS_MAX_BATCH
+extern void i2c_bus_sched_reset(i2c_bus_sched_t* sched, size_t max_batch);
+// returns 0 if that priority's queue is full
+extern int i2c_bus_sched_push(i2c_bus_sched_t* sched, const i2c_bus_request_t* request, i2c_priority_t priority);
+// pop the oldest request of the highest priority waiting, and whatever is
+// queued right behind it for the same device. returns how many
+extern size_t i2c_bus_sched_next(i2c_bus_sched_t* sched, i2c_bus_request_t* out_batch);
+// run a batch from i2c_bus_sched_next(). if it fails, each request is run
+// again on its own so one device's error isn't blamed on the rest
+extern void i2c_bus_sched_execute(const i2c_bus_request_t* batch, size_t count, i2c_bus_executor_t executor,
+                                  void* state, int* out_results);
+extern void i2c_bus_sched_record(i2c_bus_sched_t* sched, const i2c_bus_request_t* request, int result,
+                                 int64_t done_us);
+// returns 0 if the device hasn't been addressed, and zeroes out_stats
+extern int i2c_bus_sched_stats(i2c_bus_sched_t* sched, uint8_t address, i2c_bus_stats_t* out_stats, int reset);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // FREENOVE_S3_DEVKIT_CORE_H
@@ -0,0 +1,124 @@
+// Checks the packed crop and downscale against a channel at a time
+// reference, and times the two
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "freenove_s3_devkit_core.h"
+#include "test.h"
+
+// the loop camera_crop_scale() used before it summed channels in one word
+static void crop_scale_reference(const uint8_t* in, int src_width, int x,
+                                 int y, int width, int height, uint8_t* out,
+                                 int dst_width, int dst_height) {
+    for (int oy = 0; oy < dst_height; ++oy) {
+        const int y1 = y + (oy * height) / dst_height;
+        const int y2 = y + ((oy + 1) * height) / dst_height;
+        for (int ox = 0; ox < dst_width; ++ox) {
+            const int x1 = x + (ox * width) / dst_width;
+            const int x2 = x + ((ox + 1) * width) / dst_width;
+            uint32_t r = 0, g = 0, b = 0;
+            for (int sy = y1; sy < y2; ++sy) {
+                const uint8_t* p = in + (sy * src_width + x1) * 2;
+                for (int sx = x1; sx < x2; ++sx) {
+                    r += p[0] >> 3;
+                    g += ((p[0] & 0x07) << 3) | (p[1] >> 5);
+                    b += p[1] & 0x1F;
+                    p += 2;
+                }
+            }
+            const uint32_t n = (uint32_t)(x2 - x1) * (y2 - y1);
+            r = (r + n / 2) / n;
+            g = (g + n / 2) / n;
+            b = (b + n / 2) / n;
+            *(out++) = (uint8_t)((r << 3) | (g >> 3));
+            *(out++) = (uint8_t)((g << 5) | b);
+        }
+    }
+}
+
+enum { DIM = 240 };
+static uint8_t frame[DIM * DIM * 2];
+static uint8_t expected[DIM * DIM * 2];
+static uint8_t actual[DIM * DIM * 2];
+
+static void fill(uint8_t value) {
+    memset(frame, value, sizeof(frame));
+}
+static void fill_random(void) {
+    uint32_t rng = 1;
+    for (size_t i = 0; i < sizeof(frame); ++i) {
+        rng = rng * 1103515245 + 12345;
+        frame[i] = (uint8_t)(rng >> 16);
+    }
+}
+static int compare(int x, int y, int width, int height, int dst_width,
+                   int dst_height) {
+    const size_t size = (size_t)dst_width * dst_height * 2;
+    crop_scale_reference(frame, DIM, x, y, width, height, expected, dst_width,
+                         dst_height);
+    if (!camera_crop_scale(frame, DIM, DIM, x, y, width, height, actual,
+                           dst_width, dst_height)) {
+        return 0;
+    }
+    return 0 == memcmp(expected, actual, size);
+}
+
+static void test_saturated(void) {
+    // all channels at their maximum is the worst case for the packed sums:
+    // 240 to 1 squeezes whole runs of 32 pixels into each word
+    fill(0xFF);
+    CHECK(compare(0, 0, DIM, DIM, 1, 1));
+    CHECK(actual[0] == 0xFF && actual[1] == 0xFF);
+    CHECK(compare(0, 0, DIM, DIM, 7, 3));
+}
+static void test_random(void) {
+    fill_random();
+    CHECK(compare(0, 0, DIM, DIM, DIM, DIM));
+    CHECK(compare(0, 0, DIM, DIM, 120, 120));
+    CHECK(compare(0, 0, DIM, DIM, 96, 96));
+    CHECK(compare(13, 27, 200, 150, 33, 31));
+    CHECK(compare(100, 100, 64, 64, 64, 1));
+    CHECK(compare(0, 0, DIM, 1, 1, 1));
+}
+static void test_rejects(void) {
+    CHECK(!camera_crop_scale(frame, DIM, DIM, 0, 0, 10, 10, actual, 20, 5));
+    CHECK(!camera_crop_scale(frame, DIM, DIM, 0, 0, 0, 10, actual, 1, 1));
+    CHECK(!camera_crop_scale(frame, DIM, DIM, 0, 0, 10, 10, actual, 0, 1));
+    // a 240 based region on a 96x96 frame
+    CHECK(!camera_crop_scale(frame, 96, 96, 0, 0, DIM, DIM, actual, 96, 96));
+    CHECK(!camera_crop_scale(frame, 96, 96, 80, 0, 20, 20, actual, 10, 10));
+    CHECK(!camera_crop_scale(frame, 96, 96, 0, 90, 20, 20, actual, 10, 10));
+    CHECK(!camera_crop_scale(frame, 96, 96, -1, 0, 20, 20, actual, 10, 10));
+    CHECK(camera_crop_scale(frame, 96, 96, 76, 76, 20, 20, actual, 10, 10));
+}
+
+static double seconds(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+// a rough guide only. it doesn't fail the test
+static void benchmark(void) {
+    enum { ROUNDS = 200 };
+    fill_random();
+    clock_t start = clock();
+    for (int i = 0; i < ROUNDS; ++i) {
+        crop_scale_reference(frame, DIM, 0, 0, DIM, DIM, expected, 96, 96);
+    }
+    const double reference = seconds(start);
+    start = clock();
+    for (int i = 0; i < ROUNDS; ++i) {
+        camera_crop_scale(frame, DIM, DIM, 0, 0, DIM, DIM, actual, 96, 96);
+    }
+    const double packed = seconds(start);
+    printf("crop scale 240x240 to 96x96: per channel %.1f us, packed %.1f us\n",
+           reference * 1e6 / ROUNDS, packed * 1e6 / ROUNDS);
+    CHECK(0 == memcmp(expected, actual, 96 * 96 * 2));
+}
+
+int main(void) {
+    test_saturated();
+    test_random();
+    test_rejects();
+    benchmark();
+    return test_summary("camera_crop_scale_test");
+}
@@ -0,0 +1,93 @@
+// Checks the tiled rotation against per-pixel loops, and times the two
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "freenove_s3_devkit_core.h"
+#include "test.h"
+
+// the loops camera_copy_rotate() used before it was tiled
+static void rotate_per_pixel(uint16_t* out, const uint16_t* in, int rows,
+                             int cols, int rotation) {
+    for (int y = 0; y < rows; ++y) {
+        for (int x = 0; x < cols; ++x) {
+            const uint16_t px = in[y * cols + x];
+            switch (rotation & 3) {
+                case 1:
+                    out[(cols - x - 1) * rows + y] = px;
+                    break;
+                case 2:
+                    out[(rows - y - 1) * cols + (cols - x - 1)] = px;
+                    break;
+                case 3:
+                    out[x * rows + (rows - y - 1)] = px;
+                    break;
+                default:
+                    out[y * cols + x] = px;
+                    break;
+            }
+        }
+    }
+}
+
+static void test_sizes(void) {
+    // square camera frames, plus sizes that leave ragged edge tiles
+    static const int sizes[][2] = {{240, 240}, {96, 96}, {17, 33}, {1, 1},
+                                   {5, 40},    {40, 5},  {31, 16}};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        const int rows = sizes[i][0], cols = sizes[i][1];
+        const size_t count = (size_t)rows * cols;
+        uint16_t* in = malloc(count * sizeof(uint16_t));
+        uint16_t* expected = malloc(count * sizeof(uint16_t));
+        uint16_t* actual = malloc(count * sizeof(uint16_t));
+        for (size_t j = 0; j < count; ++j) {
+            in[j] = (uint16_t)(j * 2654435761u >> 16);
+        }
+        for (int rotation = 0; rotation < 4; ++rotation) {
+            rotate_per_pixel(expected, in, rows, cols, rotation);
+            memset(actual, 0, count * sizeof(uint16_t));
+            camera_rotate(actual, in, rows, cols, rotation);
+            if (memcmp(expected, actual, count * sizeof(uint16_t))) {
+                printf("%dx%d rotation %d differs\n", rows, cols, rotation);
+                ++failures;
+            }
+        }
+        free(in);
+        free(expected);
+        free(actual);
+    }
+}
+
+static double seconds(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+// the host's caches don't behave like PSRAM on the S3, so this is only a
+// rough guide. it doesn't fail the test
+static void benchmark(void) {
+    enum { ROWS = 240, COLS = 240, ROUNDS = 500 };
+    static uint16_t in[ROWS * COLS], out[ROWS * COLS];
+    for (size_t j = 0; j < ROWS * COLS; ++j) {
+        in[j] = (uint16_t)j;
+    }
+    for (int rotation = 1; rotation < 4; rotation += 2) {
+        clock_t start = clock();
+        for (int i = 0; i < ROUNDS; ++i) {
+            rotate_per_pixel(out, in, ROWS, COLS, rotation);
+        }
+        const double naive = seconds(start);
+        start = clock();
+        for (int i = 0; i < ROUNDS; ++i) {
+            camera_rotate(out, in, ROWS, COLS, rotation);
+        }
+        const double tiled = seconds(start);
+        printf("rotate %d, 240x240: per pixel %.1f us, tiled %.1f us\n",
+               rotation * 90, naive * 1e6 / ROUNDS, tiled * 1e6 / ROUNDS);
+    }
+    CHECK(out[0] != 0xFFFF);  // keep the work from being optimized away
+}
+
+int main(void) {
+    test_sizes();
+    benchmark();
+    return test_summary("camera_rotate_test");
+}
@@ -0,0 +1,205 @@
+// Drives the I2C bus scheduler against a simulated bus
+#include <stdio.h>
+#include <string.h>
+#include "freenove_s3_devkit_core.h"
+#include "test.h"
+
+// what the executor saw, a batch at a time
+typedef struct {
+    uint8_t addresses[64][I2C_BUS_MAX_BATCH];
+    size_t counts[64];
+    size_t batches;
+    // this address NACKs anything that writes this byte first
+    uint8_t nack_address;
+    uint8_t nack_byte;
+} sim_bus_t;
+static void sim_execute(const i2c_bus_request_t* requests, size_t count,
+                        int* out_results, void* state) {
+    sim_bus_t* bus = (sim_bus_t*)state;
+    if (bus->batches < 64) {
+        for (size_t i = 0; i < count; ++i) {
+            bus->addresses[bus->batches][i] = requests[i].address;
+        }
+        bus->counts[bus->batches] = count;
+    }
+    ++bus->batches;
+    int failed = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const i2c_bus_request_t* r = &requests[i];
+        const uint8_t* write = r->write != NULL ? r->write : r->inline_data;
+        if (r->address == bus->nack_address && r->write_len > 0 &&
+            write[0] == bus->nack_byte) {
+            failed = 1;
+        }
+        for (size_t j = 0; j < requests[i].read_len; ++j) {
+            requests[i].read[j] = (uint8_t)(requests[i].address + j);
+        }
+    }
+    // like a joined command link, one NACK fails the lot
+    for (size_t i = 0; i < count; ++i) {
+        out_results[i] = failed ? -1 : 0;
+    }
+}
+static i2c_bus_request_t request(uint8_t address, uint8_t reg, size_t read_len,
+                                 int64_t queued_us) {
+    static uint8_t scratch[16];
+    i2c_bus_request_t result;
+    memset(&result, 0, sizeof(result));
+    result.address = address;
+    result.inline_data[0] = reg;
+    result.write_len = 1;
+    result.read = scratch;
+    result.read_len = read_len;
+    result.queued_us = queued_us;
+    return result;
+}
+// run everything queued, the way the bus task does
+static size_t drain(i2c_bus_sched_t* sched, sim_bus_t* bus, int64_t done_us,
+                    int* out_results) {
+    size_t total = 0;
+    i2c_bus_request_t batch[I2C_BUS_MAX_BATCH];
+    size_t count;
+    while ((count = i2c_bus_sched_next(sched, batch)) > 0) {
+        int results[I2C_BUS_MAX_BATCH];
+        i2c_bus_sched_execute(batch, count, sim_execute, bus, results);
+        for (size_t i = 0; i < count; ++i) {
+            i2c_bus_sched_record(sched, &batch[i], results[i], done_us);
+            if (out_results != NULL) {
+                out_results[total + i] = results[i];
+            }
+        }
+        total += count;
+    }
+    return total;
+}
+
+static void test_priority(void) {
+    i2c_bus_sched_t sched;
+    i2c_bus_sched_reset(&sched, 1);
+    i2c_bus_request_t r = request(0x57, 0, 1, 0);
+    CHECK(i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_LOW));
+    r.address = 0x20;
+    CHECK(i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_NORMAL));
+    r.address = 0x38;
+    CHECK(i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_HIGH));
+    r.address = 0x39;
+    CHECK(i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_HIGH));
+    CHECK(!i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_COUNT));
+    sim_bus_t bus;
+    memset(&bus, 0, sizeof(bus));
+    CHECK(drain(&sched, &bus, 0, NULL) == 4);
+    // highest first, and in order within a priority
+    CHECK(bus.batches == 4);
+    CHECK(bus.addresses[0][0] == 0x38 && bus.addresses[1][0] == 0x39 &&
+          bus.addresses[2][0] == 0x20 && bus.addresses[3][0] == 0x57);
+}
+static void test_full(void) {
+    i2c_bus_sched_t sched;
+    i2c_bus_sched_reset(&sched, 4);
+    i2c_bus_request_t r = request(0x57, 0, 1, 0);
+    for (int i = 0; i < I2C_BUS_QUEUE_SIZE; ++i) {
+        CHECK(i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_NORMAL));
+    }
+    CHECK(!i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_NORMAL));
+    // the others have their own room
+    CHECK(i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_HIGH));
+}
+static void test_batching(void) {
+    // a mix of devices and priorities. batches never mix devices, never go
+    // over the limit, and never take from a lower priority queue
+    static const uint8_t addresses[] = {0x57, 0x57, 0x57, 0x57, 0x57,
+                                        0x38, 0x57, 0x38, 0x57};
+    i2c_bus_sched_t sched;
+    i2c_bus_sched_reset(&sched, 4);
+    for (size_t i = 0; i < sizeof(addresses); ++i) {
+        i2c_bus_request_t r = request(addresses[i], (uint8_t)i, 2, 0);
+        CHECK(i2c_bus_sched_push(&sched, &r, i == 8 ? I2C_PRIORITY_LOW
+                                                    : I2C_PRIORITY_NORMAL));
+    }
+    sim_bus_t bus;
+    memset(&bus, 0, sizeof(bus));
+    CHECK(drain(&sched, &bus, 0, NULL) == sizeof(addresses));
+    for (size_t b = 0; b < bus.batches; ++b) {
+        CHECK(bus.counts[b] >= 1 && bus.counts[b] <= I2C_BUS_MAX_BATCH);
+        for (size_t i = 1; i < bus.counts[b]; ++i) {
+            CHECK(bus.addresses[b][i] == bus.addresses[b][0]);
+        }
+    }
+    // 4 + 1 for 0x57, then each one that's between two of the other device
+    // on its own, then the low one
+    CHECK(bus.batches == 6);
+    CHECK(bus.counts[0] == 4 && bus.counts[1] == 1 && bus.counts[2] == 1 &&
+          bus.counts[3] == 1 && bus.counts[4] == 1 && bus.counts[5] == 1);
+    CHECK(bus.addresses[2][0] == 0x38 && bus.addresses[3][0] == 0x57 &&
+          bus.addresses[4][0] == 0x38 && bus.addresses[5][0] == 0x57);
+    // and a limit under the maximum is kept to
+    i2c_bus_sched_reset(&sched, 2);
+    for (int i = 0; i < 5; ++i) {
+        i2c_bus_request_t r = request(0x57, 0, 1, 0);
+        i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_NORMAL);
+    }
+    memset(&bus, 0, sizeof(bus));
+    drain(&sched, &bus, 0, NULL);
+    CHECK(bus.batches == 3 && bus.counts[0] == 2 && bus.counts[2] == 1);
+}
+static void test_retry(void) {
+    // the second request NACKs. the joined batch fails, and then each runs
+    // on its own so only that one reports it
+    i2c_bus_sched_t sched;
+    i2c_bus_sched_reset(&sched, 4);
+    for (int i = 0; i < 3; ++i) {
+        i2c_bus_request_t r = request(0x57, (uint8_t)(0x10 + i), 1, 0);
+        i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_NORMAL);
+    }
+    sim_bus_t bus;
+    memset(&bus, 0, sizeof(bus));
+    bus.nack_address = 0x57;
+    bus.nack_byte = 0x11;
+    int results[8];
+    CHECK(drain(&sched, &bus, 0, results) == 3);
+    CHECK(results[0] == 0 && results[1] != 0 && results[2] == 0);
+    // the batch, then one at a time
+    CHECK(bus.batches == 4 && bus.counts[0] == 3 && bus.counts[1] == 1);
+    i2c_bus_stats_t stats;
+    CHECK(i2c_bus_sched_stats(&sched, 0x57, &stats, 0));
+    CHECK(stats.transactions == 3 && stats.errors == 1);
+}
+static void test_stats(void) {
+    i2c_bus_sched_t sched;
+    i2c_bus_sched_reset(&sched, 4);
+    // queued at 0, 100 and 200us, all done at 1000us
+    i2c_bus_request_t r = request(0x38, 0, 16, 0);
+    i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_HIGH);
+    r = request(0x57, 0, 6, 100);
+    i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_NORMAL);
+    r = request(0x57, 0, 6, 200);
+    i2c_bus_sched_push(&sched, &r, I2C_PRIORITY_NORMAL);
+    sim_bus_t bus;
+    memset(&bus, 0, sizeof(bus));
+    drain(&sched, &bus, 1000, NULL);
+    i2c_bus_stats_t touch, prox, other;
+    CHECK(i2c_bus_sched_stats(&sched, 0x38, &touch, 0));
+    CHECK(i2c_bus_sched_stats(&sched, 0x57, &prox, 1));
+    CHECK(!i2c_bus_sched_stats(&sched, 0x20, &other, 0));
+    CHECK(touch.transactions == 1 && touch.bytes_written == 1 &&
+          touch.bytes_read == 16 && touch.errors == 0);
+    CHECK(touch.latency_avg_us == 1000 && touch.latency_max_us == 1000);
+    CHECK(prox.transactions == 2 && prox.bytes_written == 2 &&
+          prox.bytes_read == 12);
+    CHECK(prox.latency_avg_us == 850 && prox.latency_max_us == 900);
+    CHECK(other.transactions == 0);
+    // the reset only cleared 0x57
+    CHECK(i2c_bus_sched_stats(&sched, 0x57, &prox, 0));
+    CHECK(prox.transactions == 0);
+    CHECK(i2c_bus_sched_stats(&sched, 0x38, &touch, 0));
+    CHECK(touch.transactions == 1);
+}
+
+int main(void) {
+    test_priority();
+    test_full();
+    test_batching();
+    test_retry();
+    test_stats();
+    return test_summary("i2c_bus_test");
+}
@@ -0,0 +1,121 @@
+// Runs the flush planner over synthetic dirty rectangle streams
+#include <stdio.h>
+#include <string.h>
+#include "freenove_s3_devkit_core.h"
+#include "test.h"
+
+static lcd_rect_t rect(int x1, int y1, int x2, int y2) {
+    lcd_rect_t result = {(uint16_t)x1, (uint16_t)y1, (uint16_t)x2,
+                         (uint16_t)y2};
+    return result;
+}
+static int rect_contains(const lcd_rect_t* r, int x, int y) {
+    return x >= r->x1 && x <= r->x2 && y >= r->y1 && y <= r->y2;
+}
+static int rects_cover(const lcd_rect_t* planned, size_t count,
+                       const lcd_rect_t* r) {
+    for (int y = r->y1; y <= r->y2; ++y) {
+        for (int x = r->x1; x <= r->x2; ++x) {
+            size_t i = 0;
+            while (i < count && !rect_contains(&planned[i], x, y)) {
+                ++i;
+            }
+            if (i == count) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void test_overlapping(void) {
+    lcd_rect_t rects[2] = {rect(10, 10, 49, 49), rect(30, 30, 69, 69)};
+    // the bounding box adds two empty corners, worth it only past their size
+    CHECK(lcd_coalesce_rects(rects, 2, 0) == 2);
+    CHECK(lcd_coalesce_rects(rects, 2, 2000) == 1);
+    CHECK(rects[0].x1 == 10 && rects[0].y1 == 10 && rects[0].x2 == 69 &&
+          rects[0].y2 == 69);
+}
+static void test_stacked(void) {
+    // strips with the same columns, one under the other, merge for nothing
+    lcd_rect_t rects[3] = {rect(0, 0, 239, 37), rect(0, 38, 239, 75),
+                           rect(0, 76, 239, 113)};
+    CHECK(lcd_coalesce_rects(rects, 3, 0) == 1);
+    CHECK(rects[0].y1 == 0 && rects[0].y2 == 113);
+}
+static void test_label_and_camera(void) {
+    // the demo's fps label sits one row above the camera view
+    lcd_rect_t label = rect(0, 30, 239, 38);
+    lcd_rect_t camera = rect(0, 40, 239, 279);
+    lcd_rect_t rects[2];
+    // a blank row of 240 pixels is cheaper than another window
+    rects[0] = label;
+    rects[1] = camera;
+    CHECK(lcd_coalesce_rects(rects, 2, 384) == 1);
+    CHECK(rects[0].y1 == 30 && rects[0].y2 == 279);
+    // but not if windows are cheap
+    rects[0] = label;
+    rects[1] = camera;
+    CHECK(lcd_coalesce_rects(rects, 2, 100) == 2);
+}
+static void test_far_apart(void) {
+    lcd_rect_t rects[2] = {rect(0, 0, 9, 9), rect(200, 300, 209, 309)};
+    CHECK(lcd_coalesce_rects(rects, 2, 384) == 2);
+    // unless we're told to make do with one
+    CHECK(lcd_plan_rects(rects, 2, 1, 384) == 1);
+    CHECK(rects[0].x1 == 0 && rects[0].y1 == 0 && rects[0].x2 == 209 &&
+          rects[0].y2 == 309);
+}
+static void test_plan_picks_cheapest(void) {
+    // two close together and one far away: the close pair goes first
+    lcd_rect_t rects[3] = {rect(0, 0, 9, 9), rect(12, 0, 21, 9),
+                           rect(200, 300, 209, 309)};
+    CHECK(lcd_plan_rects(rects, 3, 2, 0) == 2);
+    CHECK(rects[0].x1 == 0 && rects[0].x2 == 21 && rects[0].y2 == 9);
+    CHECK(rects[1].x1 == 200);
+}
+
+static uint32_t rng = 12345;
+static int next_random(int max) {
+    rng = rng * 1103515245 + 12345;
+    return (int)((rng >> 16) % (uint32_t)max);
+}
+static void test_random_streams(void) {
+    for (int round = 0; round < 200; ++round) {
+        lcd_rect_t input[16], planned[16];
+        const size_t count = 1 + next_random(16);
+        for (size_t i = 0; i < count; ++i) {
+            int x = next_random(230), y = next_random(310);
+            input[i] = rect(x, y, x + next_random(240 - x),
+                            y + next_random(320 - y));
+        }
+        const uint32_t cost = (uint32_t)next_random(1000);
+        const size_t max = 1 + next_random(4);
+        memcpy(planned, input, sizeof(input));
+        size_t planned_count = lcd_plan_rects(planned, count, max, cost);
+        CHECK(planned_count >= 1 && planned_count <= max);
+        CHECK(planned_count <= count);
+        for (size_t i = 0; i < count; ++i) {
+            CHECK(rects_cover(planned, planned_count, &input[i]));
+        }
+        // coalescing alone never leaves a pair it would have merged
+        memcpy(planned, input, sizeof(input));
+        planned_count = lcd_coalesce_rects(planned, count, cost);
+        for (size_t i = 0; i < planned_count; ++i) {
+            for (size_t j = i + 1; j < planned_count; ++j) {
+                lcd_rect_t pair[2] = {planned[i], planned[j]};
+                CHECK(lcd_coalesce_rects(pair, 2, cost) == 2);
+            }
+        }
+    }
+}
+
+int main(void) {
+    test_overlapping();
+    test_stacked();
+    test_label_and_camera();
+    test_far_apart();
+    test_plan_picks_cheapest();
+    test_random_streams();
+    return test_summary("lcd_planner_test");
+}
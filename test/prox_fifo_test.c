@@ -0,0 +1,140 @@
+// Reads a simulated MAX3010x FIFO the way prox_sensor_update_impl() does
+#include <stdio.h>
+#include <string.h>
+#include "freenove_s3_devkit_core.h"
+#include "test.h"
+
+// the sensor's FIFO registers with FIFO_ROLLOVER_EN set. 0x04 is FIFO_WR_PTR,
+// 0x05 OVF_COUNTER, 0x06 FIFO_RD_PTR and reads of 0x07 pop FIFO_DATA
+typedef struct {
+    uint8_t regs[8];
+    uint8_t fifo[32][9];
+    int count;
+    int leds;
+    int byte;
+} sim_t;
+
+static void sim_reset(sim_t* sim, int leds) {
+    memset(sim, 0, sizeof(sim_t));
+    sim->leds = leds;
+}
+// the sensor takes a sample. each LED's reading has junk in the 6 bits
+// above the 18 that count, which the decoder has to mask off
+static void sim_sample(sim_t* sim, const uint32_t* values) {
+    uint8_t* slot = sim->fifo[sim->regs[0x04]];
+    for (int j = 0; j < sim->leds; ++j) {
+        const uint32_t raw = values[j] | 0xFC0000;
+        slot[j * 3] = (uint8_t)(raw >> 16);
+        slot[j * 3 + 1] = (uint8_t)(raw >> 8);
+        slot[j * 3 + 2] = (uint8_t)raw;
+    }
+    sim->regs[0x04] = (sim->regs[0x04] + 1) & 0x1F;
+    if (sim->count == 32) {
+        // full, so roll over onto the oldest
+        sim->regs[0x06] = (sim->regs[0x06] + 1) & 0x1F;
+        if (sim->regs[0x05] < 0x1F) {
+            ++sim->regs[0x05];
+        }
+    } else {
+        ++sim->count;
+    }
+}
+static void sim_read(sim_t* sim, uint8_t reg, uint8_t* out, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (reg == 0x07) {
+            // the register pointer stays put, and each read pops a byte
+            out[i] = sim->fifo[sim->regs[0x06]][sim->byte++];
+            if (sim->byte == sim->leds * 3) {
+                sim->byte = 0;
+                sim->regs[0x06] = (sim->regs[0x06] + 1) & 0x1F;
+                sim->regs[0x05] = 0;
+                --sim->count;
+            }
+        } else {
+            out[i] = sim->regs[reg++];
+        }
+    }
+}
+// what the driver does on each poll
+static int drain(sim_t* sim, prox_sample_t* out_samples) {
+    uint8_t pointers[3];
+    sim_read(sim, 0x04, pointers, sizeof(pointers));
+    const int samples =
+        prox_sensor_fifo_pending(pointers[0], pointers[1], pointers[2]);
+    uint8_t burst[32 * 3 * 3];
+    sim_read(sim, 0x07, burst, samples * sim->leds * 3);
+    prox_sensor_decode(burst, samples, sim->leds, out_samples);
+    return samples;
+}
+static void values_for(uint32_t n, uint32_t* out_values) {
+    out_values[0] = (n * 7919) & 0x3FFFF;
+    out_values[1] = (n * 104729 + 1) & 0x3FFFF;
+    out_values[2] = (n * 1299709 + 2) & 0x3FFFF;
+}
+static int matches(const prox_sample_t* sample, uint32_t n, int leds) {
+    uint32_t values[3];
+    values_for(n, values);
+    return sample->red == values[0] &&
+           sample->ir == (leds > 1 ? values[1] : 0) &&
+           sample->green == (leds > 2 ? values[2] : 0);
+}
+
+static void test_pending(void) {
+    CHECK(prox_sensor_fifo_pending(0, 0, 0) == 0);
+    CHECK(prox_sensor_fifo_pending(5, 0, 2) == 3);
+    // the write pointer has wrapped and the read pointer hasn't yet
+    CHECK(prox_sensor_fifo_pending(3, 0, 30) == 5);
+    CHECK(prox_sensor_fifo_pending(7, 4, 7) == 32);
+}
+static void test_steady(void) {
+    // polling faster than it fills, across several trips round the FIFO
+    for (int leds = 1; leds <= 3; ++leds) {
+        sim_t sim;
+        sim_reset(&sim, leds);
+        uint32_t produced = 0, consumed = 0;
+        for (int poll = 0; poll < 50; ++poll) {
+            const int burst = 1 + poll % 5;
+            for (int i = 0; i < burst; ++i) {
+                uint32_t values[3];
+                values_for(produced++, values);
+                sim_sample(&sim, values);
+            }
+            prox_sample_t samples[32];
+            const int count = drain(&sim, samples);
+            CHECK(count == burst);
+            for (int i = 0; i < count; ++i) {
+                CHECK(matches(&samples[i], consumed++, leds));
+            }
+        }
+        CHECK(produced == consumed && produced > 64);
+        CHECK(sim.count == 0);
+    }
+}
+static void test_overflow(void) {
+    // polled too late: the oldest 8 are gone and the newest 32 remain
+    sim_t sim;
+    sim_reset(&sim, 2);
+    uint32_t values[3];
+    for (int i = 0; i < 3; ++i) {
+        values_for(1000 + i, values);
+        sim_sample(&sim, values);
+    }
+    prox_sample_t samples[32];
+    CHECK(drain(&sim, samples) == 3);
+    for (uint32_t n = 0; n < 40; ++n) {
+        values_for(n, values);
+        sim_sample(&sim, values);
+    }
+    CHECK(drain(&sim, samples) == 32);
+    for (int i = 0; i < 32; ++i) {
+        CHECK(matches(&samples[i], 8 + i, 2));
+    }
+    CHECK(drain(&sim, samples) == 0);
+}
+
+int main(void) {
+    test_pending();
+    test_steady();
+    test_overflow();
+    return test_summary("prox_fifo_test");
+}
@@ -0,0 +1,144 @@
+// Replays IR traces through the presence estimator
+#include <stdio.h>
+#include <string.h>
+#include "freenove_s3_devkit_core.h"
+#include "test.h"
+
+static void feed(prox_presence_t* presence, uint32_t ir) {
+    prox_sample_t sample;
+    memset(&sample, 0, sizeof(sample));
+    sample.ir = ir;
+    prox_presence_update(presence, &sample, 1);
+}
+static void start(prox_presence_t* presence) {
+    prox_presence_initialize(presence, PROX_PRESENCE_ENTER_DEFAULT,
+                             PROX_PRESENCE_EXIT_DEFAULT,
+                             PROX_PRESENCE_FULL_SCALE_DEFAULT);
+}
+// a few counts of sensor noise either way
+static uint32_t rng = 7;
+static int noise(void) {
+    rng = rng * 1103515245 + 12345;
+    return (int)((rng >> 16) % 21) - 10;
+}
+
+// what an empty room looks like at 50 samples a second with the LEDs at 50mA
+static const uint32_t ambient_trace[] = {
+    2210, 2204, 2215, 2199, 2207, 2212, 2201, 2209, 2206, 2214, 2203, 2208,
+    2211, 2200, 2205, 2213, 2202, 2208, 2210, 2204, 2206, 2215, 2198, 2209,
+    2207, 2203, 2212, 2205, 2201, 2210, 2208, 2204, 2213, 2206, 2202, 2209};
+// a hand passing over it, and away again
+static const uint32_t hand_trace[] = {
+    2206, 2208, 2204, 2212, 2240, 2310, 2420, 2560, 2710, 2830, 2900, 2940,
+    2955, 2950, 2948, 2952, 2945, 2950, 2940, 2890, 2760, 2590, 2420, 2300,
+    2240, 2215, 2208, 2205, 2210, 2204, 2207, 2206, 2209, 2203, 2208, 2205,
+    2206, 2207, 2204, 2208, 2205, 2209, 2203, 2206};
+
+static void test_ambient(void) {
+    prox_presence_t presence;
+    start(&presence);
+    for (int round = 0; round < 10; ++round) {
+        for (size_t i = 0; i < sizeof(ambient_trace) / sizeof(uint32_t); ++i) {
+            feed(&presence, ambient_trace[i]);
+            CHECK(!presence.present);
+        }
+    }
+    CHECK(presence.signal < PROX_PRESENCE_EXIT_DEFAULT);
+    CHECK(presence.baseline > 2195 && presence.baseline < 2215);
+}
+static void test_hand(void) {
+    prox_presence_t presence;
+    start(&presence);
+    for (size_t i = 0; i < sizeof(ambient_trace) / sizeof(uint32_t); ++i) {
+        feed(&presence, ambient_trace[i]);
+    }
+    int entered = -1, left = -1;
+    for (size_t i = 0; i < sizeof(hand_trace) / sizeof(uint32_t); ++i) {
+        const int was = presence.present;
+        feed(&presence, hand_trace[i]);
+        if (!was && presence.present) {
+            entered = (int)i;
+        } else if (was && !presence.present) {
+            left = (int)i;
+        }
+    }
+    // the median and IIR lag a few samples going in, and the smoothed tail
+    // takes a while to fall under the exit threshold
+    CHECK(entered >= 5 && entered <= 10);
+    CHECK(left >= 24 && left <= 36);
+    CHECK(!presence.present);
+    // it was only there for half a second, so the baseline didn't follow it
+    CHECK(presence.baseline < 2230);
+}
+static void test_spikes(void) {
+    prox_presence_t presence;
+    start(&presence);
+    for (int i = 0; i < 500; ++i) {
+        // one sample in ten is a huge glitch
+        feed(&presence, (uint32_t)(2200 + noise() + (i % 10 == 5 ? 5000 : 0)));
+        CHECK(!presence.present);
+    }
+}
+static void test_drift(void) {
+    // ambient light creeping up over a minute isn't someone arriving
+    prox_presence_t presence;
+    start(&presence);
+    for (int i = 0; i < 3000; ++i) {
+        feed(&presence, (uint32_t)(2200 + i / 20 + noise()));
+        CHECK(!presence.present);
+    }
+}
+static void test_ambient_drop(void) {
+    // the lights go off while someone's there: the baseline drops with it,
+    // so when they leave it's ready
+    prox_presence_t presence;
+    start(&presence);
+    for (int i = 0; i < 100; ++i) {
+        feed(&presence, (uint32_t)(2200 + noise()));
+    }
+    for (int i = 0; i < 100; ++i) {
+        feed(&presence, (uint32_t)(2700 + noise()));
+    }
+    CHECK(presence.present);
+    for (int i = 0; i < 100; ++i) {
+        feed(&presence, (uint32_t)(1500 + noise()));
+    }
+    CHECK(!presence.present);
+    CHECK(presence.baseline < 1520);
+    for (int i = 0; i < 100; ++i) {
+        feed(&presence, (uint32_t)(2000 + noise()));
+    }
+    CHECK(presence.present);
+}
+static void test_distance(void) {
+    prox_presence_t presence;
+    start(&presence);
+    for (int i = 0; i < 100; ++i) {
+        feed(&presence, 2000);
+    }
+    CHECK(prox_presence_distance(&presence) < 0);
+    CHECK(!prox_presence_calibrate(&presence, 100.0f));
+    for (int i = 0; i < 100; ++i) {
+        feed(&presence, 2400);
+    }
+    CHECK(prox_presence_calibrate(&presence, 100.0f));
+    CHECK(prox_presence_distance(&presence) > 99.0f &&
+          prox_presence_distance(&presence) < 101.0f);
+    // four times the light is half the distance
+    for (int i = 0; i < 100; ++i) {
+        feed(&presence, 3600);
+    }
+    CHECK(prox_presence_distance(&presence) > 48.0f &&
+          prox_presence_distance(&presence) < 52.0f);
+    CHECK(prox_presence_level(&presence) == 1.0f);
+}
+
+int main(void) {
+    test_ambient();
+    test_hand();
+    test_spikes();
+    test_drift();
+    test_ambient_drop();
+    test_distance();
+    return test_summary("prox_presence_test");
+}
@@ -0,0 +1,100 @@
+// Checks how the prox sensor's register shadow turns into bus writes
+#include <stdio.h>
+#include <string.h>
+#include "freenove_s3_devkit_core.h"
+#include "test.h"
+
+// what went out on the simulated bus
+typedef struct {
+    uint8_t data[8][1 + PROX_SHADOW_SIZE];
+    size_t lens[8];
+    size_t count;
+    // NACK the write that would be this one, once. 0 never does
+    size_t fail_at;
+} bus_t;
+
+static int bus_write(const uint8_t* data, size_t len, void* state) {
+    bus_t* bus = (bus_t*)state;
+    if (bus->fail_at != 0 && bus->count + 1 == bus->fail_at) {
+        bus->fail_at = 0;
+        return -1;
+    }
+    if (bus->count < 8) {
+        memcpy(bus->data[bus->count], data, len);
+        bus->lens[bus->count] = len;
+    }
+    ++bus->count;
+    return 0;
+}
+static void start(prox_shadow_t* shadow, bus_t* bus) {
+    prox_shadow_reset(shadow);
+    // as if 0x08-0x12 had been read back as zeroes
+    prox_shadow_loaded(shadow, 0x08, 0x12 - 0x08 + 1);
+    memset(bus, 0, sizeof(bus_t));
+}
+
+static void test_gap(void) {
+    prox_shadow_t shadow;
+    bus_t bus;
+    start(&shadow, &bus);
+    prox_shadow_set(&shadow, 0x0A, 0x27);
+    prox_shadow_set(&shadow, 0x0C, 0x1F);
+    CHECK(prox_shadow_commit(&shadow, bus_write, &bus) == 0);
+    CHECK(bus.count == 2);
+    CHECK(bus.lens[0] == 2 && bus.data[0][0] == 0x0A && bus.data[0][1] == 0x27);
+    CHECK(bus.lens[1] == 2 && bus.data[1][0] == 0x0C && bus.data[1][1] == 0x1F);
+    CHECK(shadow.dirty == 0);
+}
+static void test_adjacent(void) {
+    prox_shadow_t shadow;
+    bus_t bus;
+    start(&shadow, &bus);
+    prox_shadow_set(&shadow, 0x0C, 0x1F);
+    prox_shadow_set(&shadow, 0x0D, 0x1F);
+    prox_shadow_set(&shadow, 0x0E, 0x1F);
+    CHECK(prox_shadow_commit(&shadow, bus_write, &bus) == 0);
+    CHECK(bus.count == 1);
+    CHECK(bus.lens[0] == 4 && bus.data[0][0] == 0x0C);
+    CHECK(bus.data[0][1] == 0x1F && bus.data[0][3] == 0x1F);
+}
+static void test_unchanged(void) {
+    prox_shadow_t shadow;
+    bus_t bus;
+    start(&shadow, &bus);
+    // the same value it already holds isn't dirty, and nothing goes out
+    prox_shadow_set(&shadow, 0x0A, 0x00);
+    CHECK(prox_shadow_mask(&shadow, 0x09, 0xF8, 0x00));
+    CHECK(prox_shadow_commit(&shadow, bus_write, &bus) == 0);
+    CHECK(bus.count == 0);
+    // a mask on a register that was never read needs it read first
+    CHECK(!prox_shadow_mask(&shadow, 0x02, 0x7F, 0x80));
+    CHECK(shadow.dirty == 0);
+    CHECK(prox_shadow_mask(&shadow, 0x0A, 0x9F, 0x20));
+    CHECK(shadow.regs[0x0A] == 0x20);
+}
+static void test_retry(void) {
+    prox_shadow_t shadow;
+    bus_t bus;
+    start(&shadow, &bus);
+    prox_shadow_set(&shadow, 0x0A, 0x27);
+    prox_shadow_set(&shadow, 0x0C, 0x1F);
+    prox_shadow_set(&shadow, 0x30, 0x10);
+    // the first run goes, the second NACKs and the third never gets a turn
+    bus.fail_at = 2;
+    CHECK(prox_shadow_commit(&shadow, bus_write, &bus) != 0);
+    CHECK(bus.count == 1);
+    CHECK(shadow.dirty == ((1ULL << 0x0C) | (1ULL << 0x30)));
+    // the next commit picks up where it left off
+    CHECK(prox_shadow_commit(&shadow, bus_write, &bus) == 0);
+    CHECK(bus.count == 3);
+    CHECK(bus.data[1][0] == 0x0C && bus.data[2][0] == 0x30);
+    CHECK(shadow.dirty == 0);
+}
+
+int main(void) {
+    test_gap();
+    test_adjacent();
+    test_unchanged();
+    test_retry();
+    return test_summary("prox_shadow_test");
+}
@@ -0,0 +1,20 @@
+// Shared by the host tests. CHECK() counts a failure and carries on, and
+// main() ends with return test_summary("name_test")
+#ifndef TEST_H
+#define TEST_H
+#include <stdio.h>
+
+static int failures = 0;
+#define CHECK(x)                                                  \
+    do {                                                          \
+        if (!(x)) {                                               \
+            printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #x); \
+            ++failures;                                           \
+        }                                                         \
+    } while (0)
+
+static int test_summary(const char* name) {
+    printf("%s: %s\n", name, failures ? "FAILED" : "passed");
+    return failures != 0;
+}
+#endif
@@ -0,0 +1,119 @@
+// Replays touch event traces through the gesture recognizer
+#include <stdio.h>
+#include <string.h>
+#include "freenove_s3_devkit_core.h"
+#include "test.h"
+
+#define MS(ms) ((int64_t)(ms) * 1000)
+#define DOWN(ms, id, x, y) {MS(ms), x, y, id, TOUCH_EVENT_DOWN}
+#define MOVE(ms, id, x, y) {MS(ms), x, y, id, TOUCH_EVENT_MOVE}
+#define UP(ms, id, x, y) {MS(ms), x, y, id, TOUCH_EVENT_UP}
+
+// feeds the trace, ticking every 13ms between events like the event task
+// does while a finger is down, and collects what comes out
+static size_t replay(const touch_event_t* events, size_t count,
+                     touch_gesture_t* out_gestures, size_t max_gestures) {
+    touch_gestures_t gestures;
+    touch_gestures_reset(&gestures);
+    size_t result = 0;
+    int64_t now = events[0].timestamp_us;
+    for (size_t i = 0; i < count; ++i) {
+        while (now + MS(13) < events[i].timestamp_us) {
+            now += MS(13);
+            result += touch_gestures_tick(&gestures, now, out_gestures + result,
+                                          max_gestures - result);
+        }
+        now = events[i].timestamp_us;
+        result += touch_gestures_feed(&gestures, &events[i],
+                                      out_gestures + result,
+                                      max_gestures - result);
+    }
+    return result;
+}
+#define REPLAY(trace, out) \
+    replay(trace, sizeof(trace) / sizeof(trace[0]), out, \
+           sizeof(out) / sizeof(out[0]))
+
+static void test_tap(void) {
+    // a little jitter stays within the slop
+    static const touch_event_t trace[] = {
+        DOWN(0, 0, 100, 100), MOVE(13, 0, 102, 101), MOVE(26, 0, 101, 103),
+        UP(120, 0, 101, 103)};
+    touch_gesture_t out[4];
+    CHECK(REPLAY(trace, out) == 1);
+    CHECK(out[0].type == TOUCH_GESTURE_TAP);
+    CHECK(out[0].x == 100 && out[0].y == 100);
+}
+static void test_long_press(void) {
+    static const touch_event_t trace[] = {DOWN(0, 0, 50, 60),
+                                          UP(900, 0, 50, 60)};
+    touch_gesture_t out[4];
+    // it fires while the finger is down, and letting go adds nothing
+    CHECK(REPLAY(trace, out) == 1);
+    CHECK(out[0].type == TOUCH_GESTURE_LONG_PRESS);
+    CHECK(out[0].timestamp_us >= MS(500) && out[0].timestamp_us < MS(520));
+}
+static void test_swipe(void) {
+    static const touch_event_t trace[] = {
+        DOWN(0, 0, 40, 160),   MOVE(13, 0, 60, 160),  MOVE(26, 0, 85, 161),
+        MOVE(39, 0, 110, 162), MOVE(52, 0, 140, 162), UP(60, 0, 140, 162)};
+    touch_gesture_t out[4];
+    CHECK(REPLAY(trace, out) == 1);
+    CHECK(out[0].type == TOUCH_GESTURE_SWIPE);
+    CHECK(out[0].x == 40 && out[0].y == 160);
+    CHECK(out[0].dx == 100 && out[0].dy == 2);
+    CHECK(out[0].velocity_x > 1000.0f);
+}
+static void test_drag_and_hold(void) {
+    // it moved far enough, but stopped before letting go
+    static const touch_event_t trace[] = {
+        DOWN(0, 0, 40, 160),   MOVE(13, 0, 70, 160), MOVE(26, 0, 100, 160),
+        MOVE(39, 0, 130, 160), UP(600, 0, 130, 160)};
+    touch_gesture_t out[4];
+    CHECK(REPLAY(trace, out) == 0);
+}
+static void test_pinch(void) {
+    static const touch_event_t trace[] = {
+        DOWN(0, 0, 100, 160),  DOWN(13, 1, 140, 160), MOVE(26, 0, 95, 160),
+        MOVE(26, 1, 145, 160), MOVE(39, 0, 80, 160),  MOVE(39, 1, 160, 160),
+        UP(52, 0, 80, 160),    UP(52, 1, 160, 160)};
+    touch_gesture_t out[8];
+    const size_t count = REPLAY(trace, out);
+    // spreading from 40 to 50 is within the slop, then each finger's move
+    // after that fires
+    CHECK(count == 2);
+    for (size_t i = 0; i < count; ++i) {
+        CHECK(out[i].type == TOUCH_GESTURE_PINCH);
+    }
+    CHECK(out[1].x == 120 && out[1].y == 160);
+    CHECK(out[1].scale > 1.9f && out[1].scale < 2.1f);
+}
+static void test_two_finger_tap(void) {
+    // neither finger counts as a tap once both are down
+    static const touch_event_t trace[] = {DOWN(0, 0, 100, 100),
+                                          DOWN(10, 1, 150, 100),
+                                          UP(80, 0, 100, 100),
+                                          UP(90, 1, 150, 100)};
+    touch_gesture_t out[4];
+    CHECK(REPLAY(trace, out) == 0);
+}
+static void test_stray_up(void) {
+    // an up for a finger we never saw down is ignored
+    static const touch_event_t trace[] = {UP(0, 3, 10, 10),
+                                          DOWN(20, 0, 10, 10),
+                                          UP(60, 0, 10, 10)};
+    touch_gesture_t out[4];
+    CHECK(REPLAY(trace, out) == 1);
+    CHECK(out[0].type == TOUCH_GESTURE_TAP);
+}
+
+int main(void) {
+    test_tap();
+    test_long_press();
+    test_swipe();
+    test_drag_and_hold();
+    test_pinch();
+    test_two_finger_tap();
+    test_stray_up();
+    return test_summary("touch_gestures_test");
+}